@@ -0,0 +1,93 @@
+#!/bin/sh
+# Benchmark distances on generated cell files.
+#
+# Usage: ./bench.sh [threads ...]           (default: 1 2 4 8)
+#
+# Environment:
+#   SIZES      cell counts to sweep (default: 10000 100000 1000000 10000000)
+#   DIST       uniform or clustered (default: uniform)
+#   SEED       generator seed (default: 1)
+#   ARGS       extra arguments for distances, e.g. -kavx2, --morton or --gemm
+#   REF        reference command run on every size up to REF_MAX cells
+#              (default: ./distances -t1 -kscalar). A relative path to
+#              its program is taken from the current directory. The default
+#              is the same build with the scalar kernel, so it checks the
+#              SIMD kernels and the threading but not code they share, such
+#              as parsing and binning. For an independent baseline, point
+#              REF at a build of an earlier commit.
+#   REF_MAX    largest size checked against REF (default: 100000). Larger
+#              sizes are checked against the run with the first thread count.
+#
+# Tuning profiles saved by --tune are ignored, for the runs and REF alike,
+# so results do not depend on the host's profile.
+#
+# Prints one CSV line per run: cells,dist,threads,seconds,pairs_per_second,check
+
+set -e
+
+export DISTANCES_PROFILE=
+
+# The runs happen in a temporary directory, so the program of REF is
+# resolved to an absolute path first. It is kept apart from its arguments,
+# as the path may contain spaces.
+ref_program=${REF%% *}
+ref_args=${REF#"$ref_program"}
+case $ref_program in
+    */*) ref_program=$(realpath "$ref_program") ;;
+esac
+
+cd "$(dirname "$0")"
+make -s distances gen_cells
+
+SIZES=${SIZES:-"10000 100000 1000000 10000000"}
+DIST=${DIST:-uniform}
+SEED=${SEED:-1}
+REF_MAX=${REF_MAX:-100000}
+THREADS=${*:-"1 2 4 8"}
+BIN=$(realpath distances)
+GEN=$(realpath gen_cells)
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+now() {
+    date +%s.%N
+}
+
+reference() {
+    if [ -n "$REF" ]; then
+        # shellcheck disable=SC2086
+        "$ref_program" $ref_args
+    else
+        "$BIN" -t1 -kscalar
+    fi
+}
+
+echo "cells,dist,threads,seconds,pairs_per_second,check"
+for cells in $SIZES; do
+    "$GEN" "$cells" "$SEED" "$DIST" > cells
+    reference=
+    if [ "$cells" -le "$REF_MAX" ]; then
+        reference > reference.out
+        reference=reference.out
+    fi
+    for threads in $THREADS; do
+        start=$(now)
+        # ARGS is split on purpose
+        # shellcheck disable=SC2086
+        "$BIN" -t"$threads" $ARGS > run.out
+        end=$(now)
+        if [ -z "$reference" ]; then
+            mv run.out first.out
+            reference=first.out
+            check=first
+        elif cmp -s run.out "$reference"; then
+            check=ok
+        else
+            check=MISMATCH
+        fi
+        awk -v n="$cells" -v d="$DIST" -v t="$threads" -v s="$start" -v e="$end" -v c="$check" \
+            'BEGIN { printf "%d,%s,%d,%.3f,%.0f,%s\n", n, d, t, e - s, n * (n - 1) / 2 / (e - s), c }'
+    done
+done
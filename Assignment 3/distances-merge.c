@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "partial_hist.h"
+
+// Sums the partial histograms of all shards of one run and prints them
+// like a single distances run would
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s partial...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    partial_hist_header_t first = { 0 };
+    uint64_t *counts = NULL;
+    uint64_t *partial = NULL;
+    char *seen = NULL;
+    for (int arg = 1; arg < argc; ++arg) {
+        FILE *file = fopen(argv[arg], "rb");
+        if (!file) {
+            fprintf(stderr, "Cannot open '%s'\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+        partial_hist_header_t header;
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, PARTIAL_HIST_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != PARTIAL_HIST_VERSION || header.shard >= header.num_shards) {
+            fprintf(stderr, "'%s' is not a partial histogram\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+
+        if (arg == 1) {
+            first = header;
+            counts = (uint64_t *)calloc(header.num_bins + 1, sizeof(uint64_t));
+            partial = (uint64_t *)malloc((header.num_bins + 1) * sizeof(uint64_t));
+            seen = (char *)calloc(header.num_shards, 1);
+            if (!counts || !partial || !seen) {
+                fprintf(stderr, "Memory allocation failed\n");
+                return EXIT_FAILURE;
+            }
+        } else if (header.num_shards != first.num_shards || header.num_bins != first.num_bins ||
+                   header.num_cells != first.num_cells || header.max_cells != first.max_cells ||
+                   header.bin_width != first.bin_width) {
+            fprintf(stderr, "'%s' belongs to a different run than '%s'\n", argv[arg], argv[1]);
+            return EXIT_FAILURE;
+        } else if (header.input_bytes != first.input_bytes || header.input_checksum != first.input_checksum) {
+            fprintf(stderr, "'%s' was computed from a different cell file than '%s'\n", argv[arg], argv[1]);
+            return EXIT_FAILURE;
+        }
+        if (seen[header.shard]) {
+            fprintf(stderr, "Shard %u/%u given twice\n", header.shard, header.num_shards);
+            return EXIT_FAILURE;
+        }
+        seen[header.shard] = 1;
+
+        if (fread(partial, sizeof(uint64_t), header.num_bins, file) != header.num_bins) {
+            fprintf(stderr, "'%s' is truncated\n", argv[arg]);
+            return EXIT_FAILURE;
+        }
+        fclose(file);
+        for (uint32_t i = 0; i < header.num_bins; ++i) {
+            counts[i] += partial[i];
+        }
+    }
+
+    for (uint32_t k = 0; k < first.num_shards; ++k) {
+        if (!seen[k]) {
+            fprintf(stderr, "Shard %u/%u is missing\n", k, first.num_shards);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Output distances and counts in sorted order
+    for (uint32_t i = 0; i < first.num_bins; ++i) {
+        if (counts[i] > 0) {
+            double distance = i * (first.bin_width / 1000.0); // Convert back to actual distance
+            printf("%05.2f %ld\n", distance, (long int)counts[i]);
+        }
+    }
+
+    free(counts);
+    free(partial);
+    free(seen);
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,129 +6,2515 @@
 #include <math.h>
 #include <stdint.h>
 #include <errno.h>
+#include <threads.h>
+#include <limits.h>
+#include <immintrin.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "partial_hist.h"
+#include "pair_kernels.h"
 
-#define MAX_DISTANCE_INDEX 3464  // Maximum distance is 34.63 units, scaled to two decimal places
 #define CELL_FILE "cells"
-#define MAX_THREADS 256  
 
-// Function to parse a single coordinate from string
-static inline int16_t parse_single_coord(const char *ptr) {
+// The usual rows of the cell file are "sDD.DDD sDD.DDD sDD.DDD\n", s being +
+// or -. Other numbers of integer digits and decimals are found by
+// detect_row_layout, but all rows of a file have the same width.
+#define ROW_BYTES 24
+
+static int row_bytes = ROW_BYTES;
+static int coord_int_digits = 2;
+static int coord_decimals = 3;
+static int32_t coord_scale = 1;      // To thousandths, 10^(3 - coord_decimals)
+
+// Coordinates are held in thousandths. They are compact, int16 minus
+// coord_offset, when the bounding box of the cells fits the int16 kernels,
+// and wide, int32, otherwise. See choose_coord_width.
+static int wide_coords = 0;
+static int coord_bytes = sizeof(int16_t);
+static int32_t coord_offset[3];
+static int64_t max_dist_sq = MAX_DISTANCE_SQ; // Of the bounding box of the cells
+
+// The bins and pair kernels of the run
+static pair_counter_t counter;
+
+// Wall time spent in each phase of the run, for --stats=json. The load
+// times are added by whichever thread loads the chunks, the rest by the
+// main thread.
+typedef struct {
+    double load;              // fetch_chunk, including the parse and writing the cache
+    double parse;             // The parallel parse in load_chunk
+    double index;             // Building grids or Morton blocks
+    double in_chunk;
+    double between_chunks;
+    double merge;
+} phase_times_t;
+
+static phase_times_t phase_times;
+
+// Function to parse a single coordinate from string, returns 0 if it is
+// not in the sDD.DDD format
+static inline int parse_single_coord(const char *ptr, int16_t *value) {
+    if ((ptr[0] != '+' && ptr[0] != '-') || ptr[3] != '.') {
+        return 0;
+    }
+    int digits[5] = { ptr[1] - '0', ptr[2] - '0', ptr[4] - '0', ptr[5] - '0', ptr[6] - '0' };
+    for (int k = 0; k < 5; ++k) {
+        if ((unsigned)digits[k] > 9) {
+            return 0;
+        }
+    }
     int sign = (ptr[0] == '-') ? -1 : 1;
 
-    int integer_part = (ptr[1] - '0') * 10 + (ptr[2] - '0'); // two digits
-    int fractional_part = (ptr[4] - '0') * 100 + (ptr[5] - '0') * 10 + (ptr[6] - '0'); // three digits
+    int integer_part = digits[0] * 10 + digits[1]; // two digits
+    int fractional_part = digits[2] * 100 + digits[3] * 10 + digits[4]; // three digits
+
+    *value = (int16_t)(sign * (integer_part * 1000 + fractional_part));
+    return 1;
+}
+
+// Function to parse a row of coordinates, returns 0 if the row is malformed
+static inline int parse_coord_row(const char *ptr, int16_t *coords) {
+    for (int i = 0; i < 3; i++) {
+        if (!parse_single_coord(ptr, &coords[i]) || ptr[7] != (i < 2 ? ' ' : '\n')) {
+            return 0;
+        }
+        ptr += 8; // Move past the current coordinate and the space
+    }
+    return 1;
+}
+
+// Parser for n consecutive rows into separate x, y and z arrays. Returns the
+// index of the first malformed row, or -1 if all of them parsed.
+// The coordinate arrays hold int16 or int32 values, see coord_bytes.
+typedef long int (*parse_rows_fn)(const char *rows, void *x_out, void *y_out, void *z_out, long int n);
+
+static long int parse_rows_scalar(const char *rows, void *x_out, void *y_out, void *z_out, long int n) {
+    int16_t *x = (int16_t *)x_out, *y = (int16_t *)y_out, *z = (int16_t *)z_out;
+    for (long int i = 0; i < n; ++i) {
+        int16_t coords[3];
+        if (!parse_coord_row(rows + i * ROW_BYTES, coords)) {
+            return i;
+        }
+        x[i] = coords[0];
+        y[i] = coords[1];
+        z[i] = coords[2];
+    }
+    return -1;
+}
+
+// The AVX2 parser puts bytes 0-15 of a row in the low lane and bytes 8-23 in
+// the high lane, so it never reads past the row. Both lanes then hold two
+// coordinates at offsets 0 and 8, the high lane repeating the middle one.
+// One compare per byte class validates the layout, and the digits become
+// integers with multiply-adds: maddubs forms [10 d1 + d2, 10 d4 + d5, d6],
+// madd weights those by [1000, 10, 1] and hadd adds the two halves.
+// The values are left in int32, see parse_row_avx2 for compact ones.
+__attribute__((target("avx2")))
+static inline int parse_row_avx2_wide(const char *row, int32_t *coords) {
+    const __m256i sign_pos = _mm256_setr_epi8(
+        -1, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 0, 0,
+        -1, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i digit_pos = _mm256_setr_epi8(
+        0, -1, -1, 0, -1, -1, -1, 0, 0, -1, -1, 0, -1, -1, -1, 0,
+        0, -1, -1, 0, -1, -1, -1, 0, 0, -1, -1, 0, -1, -1, -1, 0);
+    const __m256i separators = _mm256_setr_epi8(
+        0, 0, 0, '.', 0, 0, 0, ' ', 0, 0, 0, '.', 0, 0, 0, ' ',
+        0, 0, 0, '.', 0, 0, 0, ' ', 0, 0, 0, '.', 0, 0, 0, '\n');
+    const __m256i gather_digits = _mm256_setr_epi8(
+        1, 2, 4, 5, 6, -1, -1, -1, 9, 10, 12, 13, 14, -1, -1, -1,
+        1, 2, 4, 5, 6, -1, -1, -1, 9, 10, 12, 13, 14, -1, -1, -1);
+    const __m256i digit_weights = _mm256_setr_epi8(
+        10, 1, 10, 1, 1, 0, 0, 0, 10, 1, 10, 1, 1, 0, 0, 0,
+        10, 1, 10, 1, 1, 0, 0, 0, 10, 1, 10, 1, 1, 0, 0, 0);
+    const __m256i pair_weights = _mm256_setr_epi16(
+        1000, 10, 1, 0, 1000, 10, 1, 0, 1000, 10, 1, 0, 1000, 10, 1, 0);
+
+    __m256i bytes = _mm256_loadu2_m128i((const __m128i *)(row + 8), (const __m128i *)row);
+    __m256i digits = _mm256_sub_epi8(bytes, _mm256_set1_epi8('0'));
+    __m256i minus = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('-'));
+
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digits, _mm256_set1_epi8(9)), digits);
+    __m256i is_sign = _mm256_or_si256(minus, _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('+')));
+    __m256i is_separator = _mm256_cmpeq_epi8(bytes, separators);
+    __m256i valid = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(is_sign, sign_pos), _mm256_and_si256(is_digit, digit_pos)),
+        _mm256_andnot_si256(_mm256_or_si256(sign_pos, digit_pos), is_separator));
+    if (_mm256_movemask_epi8(valid) != -1) {
+        return 0;
+    }
+
+    __m256i parts = _mm256_maddubs_epi16(_mm256_shuffle_epi8(digits, gather_digits), digit_weights);
+    __m256i values = _mm256_madd_epi16(parts, pair_weights);
+    values = _mm256_hadd_epi32(values, values);
+
+    int negative = _mm256_movemask_epi8(minus);
+    int32_t x = _mm256_extract_epi32(values, 0);
+    int32_t y = _mm256_extract_epi32(values, 1);
+    int32_t z = _mm256_extract_epi32(values, 5);
+    coords[0] = (negative & (1 << 0)) ? -x : x;
+    coords[1] = (negative & (1 << 8)) ? -y : y;
+    coords[2] = (negative & (1 << 24)) ? -z : z;
+    return 1;
+}
+
+__attribute__((target("avx2")))
+static inline int parse_row_avx2(const char *row, int16_t *coords) {
+    int32_t wide[3];
+    if (!parse_row_avx2_wide(row, wide)) {
+        return 0;
+    }
+    coords[0] = (int16_t)wide[0];
+    coords[1] = (int16_t)wide[1];
+    coords[2] = (int16_t)wide[2];
+    return 1;
+}
+
+__attribute__((target("avx2")))
+static long int parse_rows_avx2(const char *rows, void *x_out, void *y_out, void *z_out, long int n) {
+    int16_t *x = (int16_t *)x_out, *y = (int16_t *)y_out, *z = (int16_t *)z_out;
+    int16_t coords[2][3];
+    long int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        int ok0 = parse_row_avx2(rows + i * ROW_BYTES, coords[0]);
+        int ok1 = parse_row_avx2(rows + (i + 1) * ROW_BYTES, coords[1]);
+        if (!(ok0 & ok1)) {
+            return ok0 ? i + 1 : i;
+        }
+        x[i] = coords[0][0];
+        y[i] = coords[0][1];
+        z[i] = coords[0][2];
+        x[i + 1] = coords[1][0];
+        y[i + 1] = coords[1][1];
+        z[i + 1] = coords[1][2];
+    }
+    if (i < n) {
+        if (!parse_row_avx2(rows + i * ROW_BYTES, coords[0])) {
+            return i;
+        }
+        x[i] = coords[0][0];
+        y[i] = coords[0][1];
+        z[i] = coords[0][2];
+    }
+    return -1;
+}
+
+// Parser for any layout of detect_row_layout, into compact or wide values.
+// The two above only take the usual layout into compact values without an
+// offset.
+static inline int parse_coord_generic(const char *ptr, int32_t *value) {
+    if (ptr[0] != '+' && ptr[0] != '-') {
+        return 0;
+    }
+    int32_t magnitude = 0;
+    for (int k = 1; k <= coord_int_digits; ++k) {
+        unsigned digit = (unsigned)(ptr[k] - '0');
+        if (digit > 9) {
+            return 0;
+        }
+        magnitude = magnitude * 10 + (int32_t)digit;
+    }
+    if (ptr[coord_int_digits + 1] != '.') {
+        return 0;
+    }
+    for (int k = coord_int_digits + 2; k < coord_int_digits + 2 + coord_decimals; ++k) {
+        unsigned digit = (unsigned)(ptr[k] - '0');
+        if (digit > 9) {
+            return 0;
+        }
+        magnitude = magnitude * 10 + (int32_t)digit;
+    }
+    magnitude *= coord_scale;
+    *value = ptr[0] == '-' ? -magnitude : magnitude;
+    return 1;
+}
+
+static inline int parse_row_generic(const char *row, int32_t *coords) {
+    const int width = coord_int_digits + coord_decimals + 3; // With the separator
+    for (int i = 0; i < 3; ++i) {
+        if (!parse_coord_generic(row + i * width, &coords[i]) || row[i * width + width - 1] != (i < 2 ? ' ' : '\n')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static long int parse_rows_generic(const char *rows, void *x_out, void *y_out, void *z_out, long int n) {
+    for (long int i = 0; i < n; ++i) {
+        int32_t coords[3];
+        if (!parse_row_generic(rows + i * row_bytes, coords)) {
+            return i;
+        }
+        if (wide_coords) {
+            ((int32_t *)x_out)[i] = coords[0];
+            ((int32_t *)y_out)[i] = coords[1];
+            ((int32_t *)z_out)[i] = coords[2];
+        } else {
+            ((int16_t *)x_out)[i] = (int16_t)(coords[0] - coord_offset[0]);
+            ((int16_t *)y_out)[i] = (int16_t)(coords[1] - coord_offset[1]);
+            ((int16_t *)z_out)[i] = (int16_t)(coords[2] - coord_offset[2]);
+        }
+    }
+    return -1;
+}
+
+static parse_rows_fn parse_rows = parse_rows_scalar;
+
+// Scanner that checks n consecutive rows and widens lo and hi to their
+// bounding box, which decides the width of the coordinates before any row
+// is parsed into them. Returns the index of the first malformed row, or -1.
+typedef long int (*scan_rows_fn)(const char *rows, long int n, int32_t *lo, int32_t *hi);
+
+static inline void widen_box(const int32_t *coords, int32_t *lo, int32_t *hi) {
+    for (int axis = 0; axis < 3; ++axis) {
+        lo[axis] = coords[axis] < lo[axis] ? coords[axis] : lo[axis];
+        hi[axis] = coords[axis] > hi[axis] ? coords[axis] : hi[axis];
+    }
+}
+
+static long int scan_rows_generic(const char *rows, long int n, int32_t *lo, int32_t *hi) {
+    for (long int i = 0; i < n; ++i) {
+        int32_t coords[3];
+        if (!parse_row_generic(rows + i * row_bytes, coords)) {
+            return i;
+        }
+        widen_box(coords, lo, hi);
+    }
+    return -1;
+}
+
+// The usual rows through the AVX2 parser
+__attribute__((target("avx2")))
+static long int scan_rows_avx2(const char *rows, long int n, int32_t *lo, int32_t *hi) {
+    for (long int i = 0; i < n; ++i) {
+        int32_t coords[3];
+        if (!parse_row_avx2_wide(rows + i * ROW_BYTES, coords)) {
+            return i;
+        }
+        widen_box(coords, lo, hi);
+    }
+    return -1;
+}
+
+static void set_row_layout(int int_digits, int decimals) {
+    coord_int_digits = int_digits;
+    coord_decimals = decimals;
+    coord_scale = decimals == 1 ? 100 : decimals == 2 ? 10 : 1;
+    row_bytes = 3 * (int_digits + decimals + 3);
+}
+
+// Finds the layout of the rows from the first one: a sign, 1 to 5 integer
+// digits, a point and 1 to 3 decimals for each coordinate. Returns 0 if the
+// first row has none of these.
+static int detect_row_layout(const char *text, size_t size) {
+    size_t k = 1;
+    while (k < size && text[k] >= '0' && text[k] <= '9') {
+        ++k;
+    }
+    int int_digits = (int)k - 1;
+    if (k >= size || text[k] != '.') {
+        return 0;
+    }
+    size_t point = k++;
+    while (k < size && text[k] >= '0' && text[k] <= '9') {
+        ++k;
+    }
+    int decimals = (int)(k - point - 1);
+    if (int_digits < 1 || int_digits > 5 || decimals < 1 || decimals > 3) {
+        return 0;
+    }
+    set_row_layout(int_digits, decimals);
+    return 1;
+}
+
+// Compact coordinates need every axis to span at most 32767 thousandths,
+// so the int16 differences do not wrap, and squared distances below 2^31,
+// the range of the key table. Each axis is centred when its values would
+// not fit int16 as they are. Sets max_dist_sq from the bounding box, but
+// compact cells keep at least the bins of the usual +-10 box, so appending
+// rows to such a file does not change the bins of an --incremental state.
+static void choose_coord_width(const int32_t lo[3], const int32_t hi[3], long int num_cells) {
+    int64_t diagonal_sq = 0;
+    int fits = 1;
+    for (int axis = 0; axis < 3 && num_cells > 0; ++axis) {
+        int64_t extent = (int64_t)hi[axis] - lo[axis];
+        diagonal_sq += extent * extent;
+        fits = fits && extent <= INT16_MAX;
+    }
+    wide_coords = !fits || diagonal_sq > INT32_MAX;
+    max_dist_sq = wide_coords || diagonal_sq > MAX_DISTANCE_SQ ? diagonal_sq : MAX_DISTANCE_SQ;
+    coord_bytes = wide_coords ? sizeof(int32_t) : sizeof(int16_t);
+    for (int axis = 0; axis < 3; ++axis) {
+        int centred = !wide_coords && num_cells > 0 && (lo[axis] < INT16_MIN || hi[axis] > INT16_MAX);
+        coord_offset[axis] = centred ? lo[axis] + (hi[axis] - lo[axis]) / 2 : 0;
+    }
+}
+
+// NUMA placement for --numa. Each OpenMP thread is pinned to one CPU, the
+// threads spread over the nodes in blocks, so thread_node of the calling
+// thread says which node its memory accesses are local to. Without --numa
+// everything is treated as one node.
+#define MAX_NUMA_NODES 16
+
+typedef struct {
+    int enabled;
+    int num_nodes;
+    int replicate;            // Copy the inner chunk of each chunk pair to every node
+    int huge_pages;           // Back coordinate buffers with transparent huge pages
+    int thread_node[MAX_THREADS];
+    cpu_set_t allowed;        // CPUs of the process before pinning
+} numa_config_t;
+
+static numa_config_t numa = { .num_nodes = 1 };
+
+static inline int thread_node(void) {
+    return numa.thread_node[omp_get_thread_num()];
+}
+
+// Reads a sysfs CPU list such as "0-3,8-11" into set, returns 0 if the
+// file is missing
+static int read_cpu_list(const char *path, cpu_set_t *set) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    CPU_ZERO(set);
+    int first, last;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(file);
+        if (c == '-' && fscanf(file, "%d", &last) == 1) {
+            c = fgetc(file);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+// Finds the nodes with CPUs this process may run on and pins the
+// num_threads threads of the OpenMP team. The team keeps its threads for
+// the later parallel regions of the same size, so the pinning holds for
+// the whole run.
+static void init_numa(int num_threads) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "sched_getaffinity failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    static cpu_set_t node_cpus[MAX_NUMA_NODES];
+    int num_nodes = 0;
+    for (int node = 0; node < MAX_NUMA_NODES * 4 && num_nodes < MAX_NUMA_NODES; ++node) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        cpu_set_t cpus;
+        if (read_cpu_list(path, &cpus)) {
+            CPU_AND(&cpus, &cpus, &allowed);
+            if (CPU_COUNT(&cpus) > 0) {
+                node_cpus[num_nodes++] = cpus;
+            }
+        }
+    }
+    if (num_nodes == 0) {
+        node_cpus[num_nodes++] = allowed;
+    }
+    numa.allowed = allowed;
+    num_nodes = num_nodes < num_threads ? num_nodes : num_threads;
+    numa.num_nodes = num_nodes;
+
+    // Thread t goes to node t * num_nodes / num_threads, on the CPUs of the
+    // node in turn
+    int cpu_of[MAX_THREADS];
+    for (int t = 0, rank = 0; t < num_threads; ++t) {
+        int node = (int)((long int)t * num_nodes / num_threads);
+        rank = t > 0 && node == numa.thread_node[t - 1] ? rank + 1 : 0;
+        int skip = rank % CPU_COUNT(&node_cpus[node]);
+        int cpu = 0;
+        while (!CPU_ISSET(cpu, &node_cpus[node]) || skip-- > 0) {
+            ++cpu;
+        }
+        numa.thread_node[t] = node;
+        cpu_of[t] = cpu;
+    }
+
+    int failed = 0;
+    #pragma omp parallel num_threads(num_threads) reduction(|:failed)
+    {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(cpu_of[omp_get_thread_num()], &cpu);
+        failed |= sched_setaffinity(0, sizeof(cpu), &cpu) != 0;
+    }
+    if (failed) {
+        fprintf(stderr, "Pinning threads failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Anonymous memory for coordinates, optionally backed by huge pages. With
+// touch under --numa the pages are touched by the team, each thread its
+// share of every axis as load_chunk splits the rows, so they spread over
+// the nodes instead of all landing on the main thread's node.
+static void *alloc_coords(long int cells_per_axis, int touch, size_t *size) {
+    const size_t HUGE_PAGE = 2 << 20;
+    *size = (size_t)cells_per_axis * 3 * coord_bytes;
+    if (numa.huge_pages) {
+        *size = (*size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    }
+    void *buffer = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (numa.huge_pages) {
+        madvise(buffer, *size, MADV_HUGEPAGE);
+    }
+    if (numa.enabled && touch) {
+        char *coords = (char *)buffer;
+        #pragma omp parallel
+        {
+            int nthreads = omp_get_num_threads();
+            int tid = omp_get_thread_num();
+            long int begin = cells_per_axis * tid / nthreads;
+            long int end = cells_per_axis * (tid + 1) / nthreads;
+            for (int axis = 0; axis < 3; ++axis) {
+                memset(coords + (axis * cells_per_axis + begin) * coord_bytes, 0, (end - begin) * coord_bytes);
+            }
+        }
+    }
+    return buffer;
+}
+
+// Cells begin .. begin + num_cells - 1 of chunk
+static chunk_coords_t chunk_slice(const chunk_coords_t *chunk, int begin, int num_cells) {
+    chunk_coords_t slice = { 0 };
+    if (chunk->x32) {
+        slice.x32 = chunk->x32 + begin;
+        slice.y32 = chunk->y32 + begin;
+        slice.z32 = chunk->z32 + begin;
+    } else {
+        slice.x = chunk->x + begin;
+        slice.y = chunk->y + begin;
+        slice.z = chunk->z + begin;
+    }
+    slice.num_cells = num_cells;
+    return slice;
+}
+
+// With a distance cutoff the chunks are sorted into a uniform grid whose
+// cells are at least the cutoff wide, so every pair within the cutoff lies
+// in the same or in neighbouring grid cells. Grid cells are numbered with x
+// fastest, which makes the three x neighbours of a row one contiguous range.
+#define GRID_MAX_DIM 64
+
+typedef struct {
+    chunk_coords_t sorted;   // The chunk's cells ordered by grid cell
+    int16_t *buffer;
+    int side;                // Grid cell width in thousandths
+    int origin[3];
+    int dims[3];
+    int *start;              // First sorted cell of each grid cell, plus the end
+} cell_grid_t;
+
+static inline int floor_div(int a, int b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+static inline int grid_index(const cell_grid_t *grid, int gx, int gy, int gz) {
+    return (gz * grid->dims[1] + gy) * grid->dims[0] + gx;
+}
+
+static void build_cell_grid(cell_grid_t *grid, const chunk_coords_t *chunk, int min_side) {
+    const int16_t *axes[3] = { chunk->x, chunk->y, chunk->z };
+    const int n = chunk->num_cells;
+    int lo[3] = { INT16_MAX, INT16_MAX, INT16_MAX };
+    int hi[3] = { INT16_MIN, INT16_MIN, INT16_MIN };
+    for (int axis = 0; axis < 3; ++axis) {
+        int axis_lo = INT16_MAX, axis_hi = INT16_MIN;
+        #pragma omp parallel for reduction(min:axis_lo) reduction(max:axis_hi)
+        for (int i = 0; i < n; ++i) {
+            axis_lo = axes[axis][i] < axis_lo ? axes[axis][i] : axis_lo;
+            axis_hi = axes[axis][i] > axis_hi ? axes[axis][i] : axis_hi;
+        }
+        lo[axis] = axis_lo;
+        hi[axis] = axis_hi;
+    }
+
+    // Widen the grid cells if the cutoff is small next to the chunk
+    grid->side = min_side;
+    for (int axis = 0; axis < 3; ++axis) {
+        int extent = n > 0 ? hi[axis] - lo[axis] + 1 : 1;
+        int side = (extent + GRID_MAX_DIM - 1) / GRID_MAX_DIM;
+        grid->side = side > grid->side ? side : grid->side;
+    }
+    long int num_grid_cells = 1;
+    for (int axis = 0; axis < 3; ++axis) {
+        grid->origin[axis] = n > 0 ? lo[axis] : 0;
+        grid->dims[axis] = n > 0 ? (hi[axis] - lo[axis]) / grid->side + 1 : 1;
+        num_grid_cells *= grid->dims[axis];
+    }
+
+    grid->start = (int *)calloc(num_grid_cells + 1, sizeof(int));
+    grid->buffer = (int16_t *)malloc((size_t)(n > 0 ? n : 1) * 3 * sizeof(int16_t));
+    int *cell_of = (int *)malloc((size_t)(n > 0 ? n : 1) * sizeof(int));
+    if (!grid->start || !grid->buffer || !cell_of) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Counting sort of the cells by grid cell
+    for (int i = 0; i < n; ++i) {
+        cell_of[i] = grid_index(grid, (chunk->x[i] - grid->origin[0]) / grid->side,
+                                (chunk->y[i] - grid->origin[1]) / grid->side,
+                                (chunk->z[i] - grid->origin[2]) / grid->side);
+        grid->start[cell_of[i] + 1]++;
+    }
+    for (long int c = 0; c < num_grid_cells; ++c) {
+        grid->start[c + 1] += grid->start[c];
+    }
+    int16_t *x = grid->buffer;
+    int16_t *y = grid->buffer + n;
+    int16_t *z = grid->buffer + 2 * n;
+    int *fill = (int *)malloc(num_grid_cells * sizeof(int));
+    if (!fill) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(fill, grid->start, num_grid_cells * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        int pos = fill[cell_of[i]]++;
+        x[pos] = chunk->x[i];
+        y[pos] = chunk->y[i];
+        z[pos] = chunk->z[i];
+    }
+    free(fill);
+    free(cell_of);
+
+    grid->sorted = (chunk_coords_t){ .x = x, .y = y, .z = z, .num_cells = n };
+}
+
+static void free_cell_grid(cell_grid_t *grid) {
+    free(grid->start);
+    free(grid->buffer);
+}
+
+// Distances from sorted cell i to the sorted cells [begin[r], end[r]) of
+// grid2, for each of the num_ranges ranges
+static inline void grid_row(const cell_grid_t *grid1, int i, const cell_grid_t *grid2,
+                            const int *begin, const int *end, int num_ranges, thread_hists_t *hists) {
+    long int pairs = 0;
+    for (int r = 0; r < num_ranges; ++r) {
+        pairs += end[r] - begin[r];
+    }
+    thread_hist_t *hist = pair_hists_reserve(hists, pairs);
+    const chunk_coords_t *c1 = &grid1->sorted;
+    const chunk_coords_t *c2 = &grid2->sorted;
+    for (int r = 0; r < num_ranges; ++r) {
+        counter.row(&counter, c1->x[i], c1->y[i], c1->z[i], c2->x + begin[r], c2->y + begin[r], c2->z + begin[r],
+                    end[r] - begin[r], hist->counts);
+    }
+}
+
+// Distances within a gridded chunk. Each pair of neighbouring grid cells is
+// visited once: the cell itself, its x + 1 neighbour and the three x ranges
+// at (y + 1, z), (y - 1, z + 1), (y, z + 1) and (y + 1, z + 1).
+void calculate_distances_in_grid(const cell_grid_t *grid, thread_hists_t *hists) {
+    static const int forward[4][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } }; // (dy, dz)
+    const int num_grid_cells = grid->dims[0] * grid->dims[1] * grid->dims[2];
+
+    #pragma omp parallel for schedule(dynamic, counter.task_grain)
+    for (int c = 0; c < num_grid_cells; ++c) {
+        int gx = c % grid->dims[0];
+        int gy = c / grid->dims[0] % grid->dims[1];
+        int gz = c / grid->dims[0] / grid->dims[1];
+        int xlo = gx > 0 ? gx - 1 : 0;
+        int xhi = gx + 1 < grid->dims[0] ? gx + 1 : gx;
+
+        int begin[5], end[5];
+        int num_ranges = 1;
+        for (int f = 0; f < 4; ++f) {
+            int ny = gy + forward[f][0], nz = gz + forward[f][1];
+            if (ny < 0 || ny >= grid->dims[1] || nz >= grid->dims[2]) {
+                continue;
+            }
+            begin[num_ranges] = grid->start[grid_index(grid, xlo, ny, nz)];
+            end[num_ranges] = grid->start[grid_index(grid, xhi, ny, nz) + 1];
+            num_ranges++;
+        }
+
+        // The cells after i in the same grid cell and its x + 1 neighbour
+        end[0] = grid->start[grid_index(grid, xhi, gy, gz) + 1];
+        for (int i = grid->start[c]; i < grid->start[c + 1]; ++i) {
+            begin[0] = i + 1;
+            grid_row(grid, i, grid, begin, end, num_ranges, hists);
+        }
+    }
+}
+
+// Distances between two gridded chunks: every cell of grid1 against the
+// 27 grid cells of grid2 around it
+void calculate_distances_between_grids(const cell_grid_t *grid1, const cell_grid_t *grid2, thread_hists_t *hists) {
+    const int num_grid_cells = grid1->dims[0] * grid1->dims[1] * grid1->dims[2];
+
+    #pragma omp parallel for schedule(dynamic, counter.task_grain)
+    for (int c = 0; c < num_grid_cells; ++c) {
+        for (int i = grid1->start[c]; i < grid1->start[c + 1]; ++i) {
+            int g[3];
+            g[0] = floor_div(grid1->sorted.x[i] - grid2->origin[0], grid2->side);
+            g[1] = floor_div(grid1->sorted.y[i] - grid2->origin[1], grid2->side);
+            g[2] = floor_div(grid1->sorted.z[i] - grid2->origin[2], grid2->side);
+            int lo[3], hi[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                lo[axis] = g[axis] > 0 ? g[axis] - 1 : 0;
+                hi[axis] = g[axis] + 1 < grid2->dims[axis] ? g[axis] + 1 : grid2->dims[axis] - 1;
+            }
+            if (lo[0] > hi[0]) {
+                continue;
+            }
+
+            int begin[9], end[9];
+            int num_ranges = 0;
+            for (int nz = lo[2]; nz <= hi[2]; ++nz) {
+                for (int ny = lo[1]; ny <= hi[1]; ++ny) {
+                    begin[num_ranges] = grid2->start[grid_index(grid2, lo[0], ny, nz)];
+                    end[num_ranges] = grid2->start[grid_index(grid2, hi[0], ny, nz) + 1];
+                    num_ranges++;
+                }
+            }
+            grid_row(grid1, i, grid2, begin, end, num_ranges, hists);
+        }
+    }
+}
+
+// With --morton the cells of each chunk are sorted along a Morton (Z-order)
+// curve and cut into blocks of MORTON_BLOCK_CELLS consecutive cells with a
+// bounding box. When the closest and farthest points of two boxes fall in
+// the same bin, every pair between the two blocks does too and the block
+// pair is counted in one step. Other block pairs go through the pair kernel,
+// with runs of consecutive blocks merged into one range.
+#define MORTON_BLOCK_CELLS 32
+
+typedef struct {
+    chunk_coords_t sorted;   // The chunk's cells in Morton order
+    int16_t *buffer;
+    int num_blocks;
+    int16_t (*box)[2][3];    // Lower and upper corner of each block
+} morton_blocks_t;
+
+typedef struct {
+    uint64_t code;
+    int cell;
+} morton_key_t;
+
+// Spread the 16 bits of v so they occupy every third bit
+static inline uint64_t spread_bits(uint64_t v) {
+    v = (v | (v << 32)) & 0x001f00000000ffffULL;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffULL;
+    v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v << 2)) & 0x1249249249249249ULL;
+    return v;
+}
+
+static int compare_morton_keys(const void *a, const void *b) {
+    uint64_t ka = ((const morton_key_t *)a)->code;
+    uint64_t kb = ((const morton_key_t *)b)->code;
+    return (ka > kb) - (ka < kb);
+}
+
+static void build_morton_blocks(morton_blocks_t *blocks, const chunk_coords_t *chunk) {
+    const int n = chunk->num_cells;
+    morton_key_t *keys = (morton_key_t *)malloc((size_t)(n > 0 ? n : 1) * sizeof(morton_key_t));
+    blocks->buffer = (int16_t *)malloc((size_t)(n > 0 ? n : 1) * 3 * sizeof(int16_t));
+    blocks->num_blocks = (n + MORTON_BLOCK_CELLS - 1) / MORTON_BLOCK_CELLS;
+    blocks->box = malloc((size_t)(blocks->num_blocks > 0 ? blocks->num_blocks : 1) * sizeof(*blocks->box));
+    if (!keys || !blocks->buffer || !blocks->box) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i) {
+        keys[i].code = spread_bits((uint16_t)(chunk->x[i] + 32768)) |
+                       spread_bits((uint16_t)(chunk->y[i] + 32768)) << 1 |
+                       spread_bits((uint16_t)(chunk->z[i] + 32768)) << 2;
+        keys[i].cell = i;
+    }
+    qsort(keys, n, sizeof(morton_key_t), compare_morton_keys);
+
+    int16_t *x = blocks->buffer;
+    int16_t *y = blocks->buffer + n;
+    int16_t *z = blocks->buffer + 2 * n;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i) {
+        x[i] = chunk->x[keys[i].cell];
+        y[i] = chunk->y[keys[i].cell];
+        z[i] = chunk->z[keys[i].cell];
+    }
+    free(keys);
+
+    #pragma omp parallel for schedule(static)
+    for (int b = 0; b < blocks->num_blocks; ++b) {
+        int end = (b + 1) * MORTON_BLOCK_CELLS < n ? (b + 1) * MORTON_BLOCK_CELLS : n;
+        int16_t lo[3] = { x[b * MORTON_BLOCK_CELLS], y[b * MORTON_BLOCK_CELLS], z[b * MORTON_BLOCK_CELLS] };
+        int16_t hi[3] = { lo[0], lo[1], lo[2] };
+        for (int i = b * MORTON_BLOCK_CELLS + 1; i < end; ++i) {
+            const int16_t v[3] = { x[i], y[i], z[i] };
+            for (int axis = 0; axis < 3; ++axis) {
+                lo[axis] = v[axis] < lo[axis] ? v[axis] : lo[axis];
+                hi[axis] = v[axis] > hi[axis] ? v[axis] : hi[axis];
+            }
+        }
+        memcpy(blocks->box[b][0], lo, sizeof(lo));
+        memcpy(blocks->box[b][1], hi, sizeof(hi));
+    }
+
+    blocks->sorted = (chunk_coords_t){ .x = x, .y = y, .z = z, .num_cells = n };
+}
+
+static void free_morton_blocks(morton_blocks_t *blocks) {
+    free(blocks->buffer);
+    free(blocks->box);
+}
+
+static inline int block_cells(const morton_blocks_t *blocks, int b) {
+    int end = (b + 1) * MORTON_BLOCK_CELLS;
+    return (end < blocks->sorted.num_cells ? end : blocks->sorted.num_cells) - b * MORTON_BLOCK_CELLS;
+}
+
+// Bin shared by every pair between two boxes, or -1 if the pairs may fall
+// in different bins
+static inline int common_bin(const int16_t (*box1)[3], const int16_t (*box2)[3]) {
+    uint64_t min_sq = 0, max_sq = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        int gap = box2[0][axis] - box1[1][axis];
+        int gap2 = box1[0][axis] - box2[1][axis];
+        gap = gap > gap2 ? gap : gap2;
+        gap = gap > 0 ? gap : 0;
+        int far = box2[1][axis] - box1[0][axis];
+        int far2 = box1[1][axis] - box2[0][axis];
+        far = far > far2 ? far : far2;
+        if (far > INT16_MAX) {
+            return -1; // The pair kernels would wrap this difference
+        }
+        min_sq += (uint64_t)gap * gap;
+        max_sq += (uint64_t)far * far;
+    }
+    int bin = pair_counter_bin(&counter, min_sq < UINT32_MAX ? (uint32_t)min_sq : UINT32_MAX);
+    return bin == pair_counter_bin(&counter, max_sq < UINT32_MAX ? (uint32_t)max_sq : UINT32_MAX) ? bin : -1;
+}
+
+// Distances from block a of blocks1 to blocks [b_begin, b_end) of blocks2
+static void block_row(const morton_blocks_t *blocks1, int a, const morton_blocks_t *blocks2,
+                      int b_begin, int b_end, thread_hists_t *hists) {
+    const chunk_coords_t *c1 = &blocks1->sorted;
+    const chunk_coords_t *c2 = &blocks2->sorted;
+    const int n1 = block_cells(blocks1, a);
+    int run_begin = b_begin; // First block of the current run of per-pair blocks
+
+    for (int b = b_begin; b <= b_end; ++b) {
+        int bin = b < b_end ? common_bin(blocks1->box[a], blocks2->box[b]) : -1;
+        if (b < b_end && bin < 0) {
+            continue;
+        }
+
+        // Flush the run of blocks before b pair by pair
+        if (run_begin < b) {
+            int j = run_begin * MORTON_BLOCK_CELLS;
+            int len = (b - 1) * MORTON_BLOCK_CELLS + block_cells(blocks2, b - 1) - j;
+            thread_hist_t *hist = pair_hists_reserve(hists, (long int)n1 * len);
+            for (int i = a * MORTON_BLOCK_CELLS; i < a * MORTON_BLOCK_CELLS + n1; ++i) {
+                counter.row(&counter, c1->x[i], c1->y[i], c1->z[i], c2->x + j, c2->y + j, c2->z + j, len,
+                            hist->counts);
+            }
+        }
+        if (b < b_end) {
+            long int pairs = (long int)n1 * block_cells(blocks2, b);
+            pair_hists_reserve(hists, pairs)->counts[bin] += (uint32_t)pairs;
+        }
+        run_begin = b + 1;
+    }
+}
+
+void calculate_distances_in_blocks(const morton_blocks_t *blocks, thread_hists_t *hists) {
+    const chunk_coords_t *c = &blocks->sorted;
+
+    #pragma omp parallel for schedule(dynamic, counter.task_grain)
+    for (int a = 0; a < blocks->num_blocks; ++a) {
+        // Pairs inside block a
+        const int begin = a * MORTON_BLOCK_CELLS;
+        const int end = begin + block_cells(blocks, a);
+        thread_hist_t *hist = pair_hists_reserve(hists, (long int)(end - begin) * (end - begin - 1) / 2);
+        for (int i = begin; i < end - 1; ++i) {
+            counter.row(&counter, c->x[i], c->y[i], c->z[i], c->x + i + 1, c->y + i + 1, c->z + i + 1, end - i - 1,
+                        hist->counts);
+        }
+
+        block_row(blocks, a, blocks, a + 1, blocks->num_blocks, hists);
+    }
+}
+
+void calculate_distances_between_blocks(const morton_blocks_t *blocks1, const morton_blocks_t *blocks2,
+                                        thread_hists_t *hists) {
+    #pragma omp parallel for schedule(dynamic, counter.task_grain)
+    for (int a = 0; a < blocks1->num_blocks; ++a) {
+        block_row(blocks1, a, blocks2, 0, blocks2->num_blocks, hists);
+    }
+}
+
+// Map the whole cell file read-only. Returns NULL for an empty file.
+static const char *map_cell_file(const char *path, size_t *file_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "fstat failed: %s\n", strerror(errno));
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    *file_size = (size_t)st.st_size;
+    if (*file_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, *file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps the file referenced
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    madvise(data, *file_size, MADV_SEQUENTIAL);
+    return (const char *)data;
+}
+
+// Page-aligned madvise over a byte range of the mapped file
+static void advise_range(const char *data, size_t offset, size_t length, int advice) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = offset & ~(page - 1);
+    madvise((void *)(data + begin), offset + length - begin, advice);
+}
+
+// Parse num_cells rows starting at row first_cell of the mapped file,
+// splitting the rows over the OpenMP team. Exits with the line number of
+// the first malformed row.
+void load_chunk(const char *data, void *x, void *y, void *z, long int first_cell, int num_cells) {
+    const char *rows = data + first_cell * row_bytes;
+    long int bad_row = LONG_MAX;
+    double start = omp_get_wtime();
+
+    #pragma omp parallel reduction(min:bad_row)
+    {
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        long int begin = (long int)num_cells * tid / nthreads;
+        long int end = (long int)num_cells * (tid + 1) / nthreads;
+
+        long int bad = parse_rows(rows + begin * row_bytes, (char *)x + begin * coord_bytes,
+                                  (char *)y + begin * coord_bytes, (char *)z + begin * coord_bytes, end - begin);
+        if (bad >= 0) {
+            bad_row = begin + bad;
+        }
+    }
+    phase_times.parse += omp_get_wtime() - start;
+
+    if (bad_row != LONG_MAX) {
+        fprintf(stderr, "Malformed row %ld in '%s'\n", first_cell + bad_row + 1, CELL_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    // The rows now live in coords, so drop them from our resident set. The
+    // page cache keeps them for the next time this chunk is loaded.
+    advise_range(data, (size_t)first_cell * row_bytes, (size_t)num_cells * row_bytes, MADV_DONTNEED);
+}
+
+// The binary cache next to the cell file holds the parsed coordinates after
+// an 80-byte header as three int16 arrays, all x, then all y, then all z, so
+// warm runs map the chunks directly. Only compact coordinates are cached,
+// and the header keeps what the scan of the cell file found about them.
+// It is tied to the size and modification time of the cell file and is only
+// renamed into place once every chunk has been written.
+#define CACHE_FILE CELL_FILE ".cache"
+#define CACHE_MAGIC "DISTCELL"
+#define CACHE_VERSION 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t num_cells;
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t checksum;
+    int64_t max_dist_sq;
+    int32_t coord_offset[3];
+    uint8_t int_digits;       // Row layout of the cell file
+    uint8_t decimals;
+    uint16_t reserved;
+} cache_header_t;
+
+// Where the coordinates of each chunk come from
+typedef struct {
+    long int num_cells;
+    int max_cells;            // Cells per chunk
+    int num_chunks;
+    long int split_cell;      // Chunks from split_chunk on start here, zero if not split
+    int split_chunk;
+    const char *text;         // Mapped cell file, NULL when reading the cache
+    size_t text_size;
+    const int16_t *cached;    // x array in the mapped cache, NULL if not used
+    void *cache_map;
+    size_t cache_size;
+    int use_cache;
+    int cache_fd;             // Cache written on this run, -1 if none
+    char *cache_written;      // Chunks already in the cache being written
+    long int bytes_read;      // Bytes of text or cache the chunks were loaded from
+    uint64_t checksum;
+    struct stat source;
+} cell_source_t;
+
+// First cell of chunk. All chunks but the last one before the split and the
+// last one after it are full.
+static long int chunk_first_cell(const cell_source_t *src, int chunk) {
+    if (chunk < src->split_chunk) {
+        return (long int)chunk * src->max_cells;
+    }
+    return src->split_cell + (long int)(chunk - src->split_chunk) * src->max_cells;
+}
+
+static int source_chunk_cells(const cell_source_t *src, int chunk) {
+    long int end = chunk < src->split_chunk ? src->split_cell : src->num_cells;
+    long int remaining = end - chunk_first_cell(src, chunk);
+    return (int)(remaining < src->max_cells ? remaining : src->max_cells);
+}
+
+// Position dependent checksum of values first_value .. first_value + n - 1
+static uint64_t coords_checksum(const int16_t *coords, long int n, long int first_value) {
+    uint64_t sum = 0;
+    #pragma omp parallel for reduction(+:sum) schedule(static)
+    for (long int k = 0; k < n; ++k) {
+        sum += ((uint64_t)(uint16_t)coords[k] + 1) * (2 * (uint64_t)(first_value + k) + 1);
+    }
+    return sum;
+}
+
+// Map the cache if it matches the cell file, otherwise leave src untouched
+static void open_cell_cache(cell_source_t *src) {
+    int fd = open(CACHE_FILE, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    cache_header_t header;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, 8) != 0 || header.version != CACHE_VERSION ||
+        header.header_size != sizeof(header) ||
+        (uint64_t)st.st_size != sizeof(header) + header.num_cells * 3 * sizeof(int16_t) ||
+        header.source_size != (uint64_t)src->source.st_size ||
+        header.source_mtime_sec != (int64_t)src->source.st_mtim.tv_sec ||
+        header.source_mtime_nsec != (int64_t)src->source.st_mtim.tv_nsec) {
+        fprintf(stderr, "Ignoring stale cache '%s'\n", CACHE_FILE);
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    const int16_t *coords = (const int16_t *)((const char *)map + sizeof(header));
+    // The checksum numbers the values in file order, x, y then z
+    if (coords_checksum(coords, (long int)header.num_cells * 3, 0) != header.checksum) {
+        fprintf(stderr, "Ignoring corrupt cache '%s'\n", CACHE_FILE);
+        munmap(map, (size_t)st.st_size);
+        return;
+    }
+
+    src->num_cells = (long int)header.num_cells;
+    set_row_layout(header.int_digits, header.decimals);
+    max_dist_sq = header.max_dist_sq;
+    memcpy(coord_offset, header.coord_offset, sizeof(coord_offset));
+    src->cached = coords;
+    src->cache_map = map;
+    src->cache_size = (size_t)st.st_size;
+}
+
+// Start writing a new cache, chunks are added as they are parsed
+static void create_cell_cache(cell_source_t *src) {
+    if (src->num_chunks == 0) {
+        return;
+    }
+    src->cache_fd = open(CACHE_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    src->cache_written = (char *)calloc(src->num_chunks, 1);
+    if (src->cache_fd < 0 || !src->cache_written) {
+        fprintf(stderr, "Cannot write cache '%s', continuing without it\n", CACHE_FILE);
+        if (src->cache_fd >= 0) {
+            close(src->cache_fd);
+            unlink(CACHE_FILE ".tmp");
+        }
+        free(src->cache_written);
+        src->cache_fd = -1;
+        src->cache_written = NULL;
+    }
+}
+
+static void abandon_cell_cache(cell_source_t *src) {
+    fprintf(stderr, "Writing cache '%s' failed: %s\n", CACHE_FILE, strerror(errno));
+    close(src->cache_fd);
+    unlink(CACHE_FILE ".tmp");
+    src->cache_fd = -1;
+}
+
+static void write_cache_chunk(cell_source_t *src, int chunk, const chunk_coords_t *coords) {
+    const int16_t *axes[3] = { coords->x, coords->y, coords->z };
+    size_t bytes = (size_t)coords->num_cells * sizeof(int16_t);
+    for (int axis = 0; axis < 3; ++axis) {
+        long int first_value = axis * src->num_cells + chunk_first_cell(src, chunk);
+        off_t offset = (off_t)(sizeof(cache_header_t) + first_value * sizeof(int16_t));
+        if (pwrite(src->cache_fd, axes[axis], bytes, offset) != (ssize_t)bytes) {
+            abandon_cell_cache(src);
+            return;
+        }
+        src->checksum += coords_checksum(axes[axis], coords->num_cells, first_value);
+    }
+    src->cache_written[chunk] = 1;
+}
+
+// Write the header and move the cache into place if it is complete
+static void finish_cell_cache(cell_source_t *src) {
+    if (src->cache_fd < 0) {
+        return;
+    }
+    for (int chunk = 0; chunk < src->num_chunks; ++chunk) {
+        if (!src->cache_written[chunk]) {
+            close(src->cache_fd);
+            unlink(CACHE_FILE ".tmp");
+            src->cache_fd = -1;
+            return;
+        }
+    }
+
+    cache_header_t header = {0};
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.version = CACHE_VERSION;
+    header.header_size = sizeof(header);
+    header.num_cells = (uint64_t)src->num_cells;
+    header.source_size = (uint64_t)src->source.st_size;
+    header.source_mtime_sec = (int64_t)src->source.st_mtim.tv_sec;
+    header.source_mtime_nsec = (int64_t)src->source.st_mtim.tv_nsec;
+    header.checksum = src->checksum;
+    header.max_dist_sq = max_dist_sq;
+    memcpy(header.coord_offset, coord_offset, sizeof(coord_offset));
+    header.int_digits = (uint8_t)coord_int_digits;
+    header.decimals = (uint8_t)coord_decimals;
+    if (pwrite(src->cache_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        fsync(src->cache_fd) != 0 || rename(CACHE_FILE ".tmp", CACHE_FILE) != 0) {
+        abandon_cell_cache(src);
+        return;
+    }
+    close(src->cache_fd);
+    src->cache_fd = -1;
+}
+
+// Check every row and find the bounding box of the cells, which decides
+// the width of their coordinates and the parser for the rows. The usual
+// rows are scanned with the AVX2 parser, split over the OpenMP team like
+// load_chunk.
+static void scan_cell_file(const cell_source_t *src) {
+    int32_t lo[3] = { INT32_MAX, INT32_MAX, INT32_MAX };
+    int32_t hi[3] = { INT32_MIN, INT32_MIN, INT32_MIN };
+    long int bad_row = LONG_MAX;
+    double start = omp_get_wtime();
+    scan_rows_fn scan_rows = scan_rows_generic;
+    if (coord_int_digits == 2 && coord_decimals == 3 && __builtin_cpu_supports("avx2")) {
+        scan_rows = scan_rows_avx2;
+    }
+
+    #pragma omp parallel reduction(min:bad_row, lo[:3]) reduction(max:hi[:3])
+    {
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        long int begin = src->num_cells * tid / nthreads;
+        long int end = src->num_cells * (tid + 1) / nthreads;
+
+        long int bad = scan_rows(src->text + begin * row_bytes, end - begin, lo, hi);
+        if (bad >= 0) {
+            bad_row = begin + bad;
+        }
+    }
+    phase_times.parse += omp_get_wtime() - start;
+
+    if (bad_row != LONG_MAX) {
+        fprintf(stderr, "Malformed row %ld in '%s'\n", bad_row + 1, CELL_FILE);
+        exit(EXIT_FAILURE);
+    }
+    choose_coord_width(lo, hi, src->num_cells);
+
+    // The fast parsers only take the usual rows into compact coordinates
+    // that need no offset
+    int usual = coord_int_digits == 2 && coord_decimals == 3 && !wide_coords &&
+                coord_offset[0] == 0 && coord_offset[1] == 0 && coord_offset[2] == 0;
+    if (!usual) {
+        parse_rows = parse_rows_generic;
+    } else if (__builtin_cpu_supports("avx2")) {
+        parse_rows = parse_rows_avx2;
+    } else {
+        parse_rows = parse_rows_scalar;
+    }
+}
+
+// Open the cell file, or its cache when use_cache is set and the cache is
+// valid, and set up the layout and width of the coordinates
+static void open_cell_source(cell_source_t *src, int use_cache) {
+    memset(src, 0, sizeof(*src));
+    src->use_cache = use_cache;
+    src->cache_fd = -1;
+
+    if (use_cache) {
+        if (stat(CELL_FILE, &src->source) != 0) {
+            fprintf(stderr, "Failed to open file '%s'\n", CELL_FILE);
+            exit(EXIT_FAILURE);
+        }
+        open_cell_cache(src);
+    }
+    if (src->cached) {
+        return;
+    }
+
+    src->text = map_cell_file(CELL_FILE, &src->text_size);
+    if (src->text && !detect_row_layout(src->text, src->text_size)) {
+        fprintf(stderr, "Malformed row 1 in '%s'\n", CELL_FILE);
+        exit(EXIT_FAILURE);
+    }
+    src->num_cells = (long int)(src->text_size / row_bytes);
+    if (src->text_size % row_bytes != 0) {
+        fprintf(stderr, "Malformed row %ld in '%s': file ends inside the row\n", src->num_cells + 1, CELL_FILE);
+        exit(EXIT_FAILURE);
+    }
+    scan_cell_file(src);
+}
+
+// Split the cells into chunks of max_cells. With use_cache and no valid
+// cache, the cache is written as the chunks are parsed.
+static void chunk_cell_source(cell_source_t *src, int max_cells) {
+    src->max_cells = max_cells;
+    src->num_chunks = (int)((src->num_cells + max_cells - 1) / max_cells);
+
+    if (src->use_cache && !src->cached) {
+        if (wide_coords) {
+            fprintf(stderr, "Cache '%s' only holds compact coordinates, continuing without it\n", CACHE_FILE);
+        } else {
+            create_cell_cache(src);
+        }
+    }
+}
+
+// Start a new chunk at split_cell, so no chunk holds cells from both sides
+static void split_cell_source(cell_source_t *src, long int split_cell) {
+    src->split_cell = split_cell;
+    src->split_chunk = (int)((split_cell + src->max_cells - 1) / src->max_cells);
+    src->num_chunks = src->split_chunk + (int)((src->num_cells - split_cell + src->max_cells - 1) / src->max_cells);
+    if (src->cache_written) {
+        free(src->cache_written);
+        src->cache_written = (char *)calloc(src->num_chunks + 1, 1);
+        if (!src->cache_written) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void close_cell_source(cell_source_t *src) {
+    finish_cell_cache(src);
+    free(src->cache_written);
+    if (src->text) {
+        munmap((void *)src->text, src->text_size);
+    }
+    if (src->cache_map) {
+        munmap(src->cache_map, src->cache_size);
+    }
+}
+
+// Coordinates of chunk, either straight from the cache or parsed into
+// buffer, which has room for the x, y and z arrays of max_cells cells
+static chunk_coords_t fetch_chunk(cell_source_t *src, int chunk, void *buffer) {
+    long int first_cell = chunk_first_cell(src, chunk);
+    chunk_coords_t coords = { 0 };
+    coords.num_cells = source_chunk_cells(src, chunk);
+    if (src->cached) {
+        src->bytes_read += (long int)coords.num_cells * 3 * sizeof(int16_t);
+        coords.x = src->cached + first_cell;
+        coords.y = src->cached + src->num_cells + first_cell;
+        coords.z = src->cached + 2 * src->num_cells + first_cell;
+        return coords;
+    }
+    double start = omp_get_wtime();
+
+    char *x = (char *)buffer;
+    char *y = x + (size_t)src->max_cells * coord_bytes;
+    char *z = y + (size_t)src->max_cells * coord_bytes;
+    src->bytes_read += (long int)coords.num_cells * row_bytes;
+    load_chunk(src->text, x, y, z, first_cell, coords.num_cells);
+    if (wide_coords) {
+        coords.x32 = (const int32_t *)x;
+        coords.y32 = (const int32_t *)y;
+        coords.z32 = (const int32_t *)z;
+    } else {
+        coords.x = (const int16_t *)x;
+        coords.y = (const int16_t *)y;
+        coords.z = (const int16_t *)z;
+    }
+    if (src->cache_fd >= 0 && !src->cache_written[chunk]) {
+        write_cache_chunk(src, chunk, &coords);
+    }
+    phase_times.load += omp_get_wtime() - start;
+    return coords;
+}
+
+// Start reading a chunk from disk before it is needed
+static void prefetch_chunk(const cell_source_t *src, int chunk) {
+    long int first_cell = chunk_first_cell(src, chunk);
+    int num_cells = source_chunk_cells(src, chunk);
+    if (src->cached) {
+        for (int axis = 0; axis < 3; ++axis) {
+            advise_range(src->cache_map, sizeof(cache_header_t) + (size_t)(axis * src->num_cells + first_cell) * sizeof(int16_t),
+                         (size_t)num_cells * sizeof(int16_t), MADV_WILLNEED);
+        }
+    } else {
+        advise_range(src->text, (size_t)first_cell * row_bytes, (size_t)num_cells * row_bytes, MADV_WILLNEED);
+    }
+}
+
+// Hands out the chunks of a fixed load sequence in order, each in one of
+// num_buffers buffers. Synchronously it parses each chunk when asked for
+// it. In pipelined mode a loader thread parses the next chunks of the
+// sequence into the free buffers while the team computes.
+typedef struct {
+    cell_source_t *src;
+    const int *sequence;      // Chunks in the order they are asked for
+    long int sequence_length;
+    long int next;            // Next position in the sequence to hand out
+    int pipelined;
+    int num_buffers;
+    void **buffers;
+    size_t buffer_size;
+    int *in_use;
+
+    // Pipelined mode only, all guarded by mtx
+    thrd_t thread;
+    mtx_t mtx;
+    cnd_t cnd;
+    long int loaded;          // Positions of the sequence loaded so far
+    int *ready_buffer;        // Buffers of positions next .. loaded - 1, by position % num_buffers
+    chunk_coords_t *ready_coords;
+} chunk_loader_t;
+
+static int loader_thread(void *arg) {
+    chunk_loader_t *loader = (chunk_loader_t *)arg;
+    // Parse on this thread only, the team is busy with the kernels. It was
+    // created by the pinned main thread, so under --numa it would share the
+    // CPU of thread 0 without going back to all the process's CPUs.
+    omp_set_num_threads(1);
+    if (numa.enabled && sched_setaffinity(0, sizeof(numa.allowed), &numa.allowed) != 0) {
+        fprintf(stderr, "Unpinning the loader thread failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (long int pos = 0; pos < loader->sequence_length; ++pos) {
+        // Wait for a buffer that is neither in use nor holding a loaded chunk
+        mtx_lock(&loader->mtx);
+        int buffer;
+        for (;;) {
+            for (buffer = 0; buffer < loader->num_buffers && loader->in_use[buffer]; ++buffer)
+                ;
+            if (buffer < loader->num_buffers) {
+                break;
+            }
+            cnd_wait(&loader->cnd, &loader->mtx);
+        }
+        loader->in_use[buffer] = 1;
+        mtx_unlock(&loader->mtx);
+
+        chunk_coords_t coords = fetch_chunk(loader->src, loader->sequence[pos], loader->buffers[buffer]);
+
+        mtx_lock(&loader->mtx);
+        loader->ready_buffer[pos % loader->num_buffers] = buffer;
+        loader->ready_coords[pos % loader->num_buffers] = coords;
+        loader->loaded = pos + 1;
+        mtx_unlock(&loader->mtx);
+        cnd_broadcast(&loader->cnd);
+    }
+    return 0;
+}
+
+static void start_chunk_loader(chunk_loader_t *loader, cell_source_t *src,
+                               const int *sequence, long int sequence_length,
+                               int num_buffers, int pipelined) {
+    memset(loader, 0, sizeof(*loader));
+    loader->src = src;
+    loader->sequence = sequence;
+    loader->sequence_length = sequence_length;
+    loader->pipelined = pipelined;
+    loader->num_buffers = num_buffers;
+    loader->buffers = (void **)calloc(num_buffers, sizeof(void *));
+    loader->in_use = (int *)calloc(num_buffers, sizeof(int));
+    loader->ready_buffer = (int *)calloc(num_buffers, sizeof(int));
+    loader->ready_coords = (chunk_coords_t *)calloc(num_buffers, sizeof(chunk_coords_t));
+    if (!loader->buffers || !loader->in_use || !loader->ready_buffer || !loader->ready_coords) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int b = 0; b < num_buffers; ++b) {
+        loader->buffers[b] = alloc_coords(src->max_cells, 1, &loader->buffer_size);
+    }
+
+    if (pipelined) {
+        mtx_init(&loader->mtx, mtx_plain);
+        cnd_init(&loader->cnd);
+        if (thrd_create(&loader->thread, loader_thread, loader) != thrd_success) {
+            fprintf(stderr, "failed to create loader thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Coordinates of the next chunk in the sequence, held until release_chunk
+static chunk_coords_t next_chunk(chunk_loader_t *loader, int *buffer) {
+    long int pos = loader->next++;
+    if (!loader->pipelined) {
+        for (*buffer = 0; loader->in_use[*buffer]; ++*buffer)
+            ;
+        loader->in_use[*buffer] = 1;
+        chunk_coords_t coords = fetch_chunk(loader->src, loader->sequence[pos], loader->buffers[*buffer]);
+        if (pos + 1 < loader->sequence_length) {
+            prefetch_chunk(loader->src, loader->sequence[pos + 1]);
+        }
+        return coords;
+    }
+
+    mtx_lock(&loader->mtx);
+    while (loader->loaded <= pos) {
+        cnd_wait(&loader->cnd, &loader->mtx);
+    }
+    *buffer = loader->ready_buffer[pos % loader->num_buffers];
+    chunk_coords_t coords = loader->ready_coords[pos % loader->num_buffers];
+    mtx_unlock(&loader->mtx);
+    return coords;
+}
+
+static void release_chunk(chunk_loader_t *loader, int buffer) {
+    if (!loader->pipelined) {
+        loader->in_use[buffer] = 0;
+        return;
+    }
+    mtx_lock(&loader->mtx);
+    loader->in_use[buffer] = 0;
+    mtx_unlock(&loader->mtx);
+    cnd_broadcast(&loader->cnd);
+}
+
+static void stop_chunk_loader(chunk_loader_t *loader) {
+    if (loader->pipelined) {
+        thrd_join(loader->thread, NULL);
+        mtx_destroy(&loader->mtx);
+        cnd_destroy(&loader->cnd);
+    }
+    for (int b = 0; b < loader->num_buffers; ++b) {
+        munmap(loader->buffers[b], loader->buffer_size);
+    }
+    free(loader->buffers);
+    free(loader->in_use);
+    free(loader->ready_buffer);
+    free(loader->ready_coords);
+}
+
+// With --numa=replicate the inner chunk of each pair between chunks is
+// copied to every node, the copy for a node made by the threads pinned to
+// it, and kept until another chunk is the inner one. Every thread then
+// streams the inner chunk from local memory.
+typedef struct {
+    int chunk;                // Chunk held, -1 if none
+    size_t size;
+    int16_t *buffers[MAX_NUMA_NODES];
+    chunk_coords_t copies[MAX_NUMA_NODES];
+} chunk_replicas_t;
+
+static void init_chunk_replicas(chunk_replicas_t *replicas, int max_cells) {
+    replicas->chunk = -1;
+    for (int node = 0; node < numa.num_nodes; ++node) {
+        replicas->buffers[node] = alloc_coords(max_cells, 0, &replicas->size);
+    }
+}
+
+static const chunk_coords_t *replicate_chunk(chunk_replicas_t *replicas, int chunk, const chunk_coords_t *coords,
+                                             int max_cells) {
+    if (replicas->chunk == chunk) {
+        return replicas->copies;
+    }
+    const int n = coords->num_cells;
+    #pragma omp parallel
+    {
+        // Threads first to last - 1 are the ones on this thread's node
+        int nthreads = omp_get_num_threads();
+        int tid = omp_get_thread_num();
+        int node = numa.thread_node[tid];
+        int first = tid, last = tid + 1;
+        while (first > 0 && numa.thread_node[first - 1] == node) --first;
+        while (last < nthreads && numa.thread_node[last] == node) ++last;
+        long int begin = (long int)n * (tid - first) / (last - first);
+        long int end = (long int)n * (tid - first + 1) / (last - first);
+
+        int16_t *buffer = replicas->buffers[node];
+        memcpy(buffer + begin, coords->x + begin, (end - begin) * sizeof(int16_t));
+        memcpy(buffer + max_cells + begin, coords->y + begin, (end - begin) * sizeof(int16_t));
+        memcpy(buffer + 2 * max_cells + begin, coords->z + begin, (end - begin) * sizeof(int16_t));
+    }
+    for (int node = 0; node < numa.num_nodes; ++node) {
+        int16_t *buffer = replicas->buffers[node];
+        replicas->copies[node] = (chunk_coords_t){ .x = buffer, .y = buffer + max_cells, .z = buffer + 2 * max_cells,
+                                                   .num_cells = n };
+    }
+    replicas->chunk = chunk;
+    return replicas->copies;
+}
+
+static void free_chunk_replicas(chunk_replicas_t *replicas) {
+    for (int node = 0; node < numa.num_nodes; ++node) {
+        munmap(replicas->buffers[node], replicas->size);
+    }
+}
+
+// The chunk pairs to compute are a plan: (i, i) for the pairs within chunk
+// i, (i, j) for those between chunks i and j. Walking the plan with room
+// for capacity resident chunks turns it into actions. When a chunk must be
+// loaded into a full set, the resident chunk whose next use is farthest
+// away is evicted, and chunks that are never used again are released
+// straight away so their buffers are free for the loader.
+typedef struct {
+    int i;
+    int j;
+} chunk_pair_t;
+
+enum { ACTION_LOAD, ACTION_RELEASE, ACTION_PAIR };
+
+typedef struct {
+    int type;
+    int chunk;   // Chunk loaded or released, first chunk of a pair
+    int other;   // Second chunk of a pair
+} chunk_action_t;
+
+typedef struct {
+    chunk_action_t *actions;
+    long int num_actions;
+    int *loads;              // Chunks in load order, for the loader
+    long int num_loads;
+} chunk_schedule_t;
+
+// Block nested loop order for capacity resident chunks: blocks of
+// capacity - 1 chunks are compared among themselves, then against every
+// later chunk streamed through the remaining slot. The stream runs from the
+// last chunk down, so it ends on the first chunk of the next block, which
+// then stays resident.
+static chunk_pair_t *block_plan(int num_chunks, int capacity, long int *num_pairs) {
+    int block = capacity - 1 < num_chunks ? capacity - 1 : num_chunks;
+    block = block > 0 ? block : 1;
+    chunk_pair_t *plan = (chunk_pair_t *)malloc(((long int)num_chunks * (num_chunks + 1) / 2 + 1) * sizeof(chunk_pair_t));
+    if (!plan) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    long int n = 0;
+    for (int start = 0; start < num_chunks; start += block) {
+        int end = start + block < num_chunks ? start + block : num_chunks;
+        for (int a = start; a < end; ++a) {
+            plan[n++] = (chunk_pair_t){ a, a };
+            for (int b = start; b < a; ++b) {
+                plan[n++] = (chunk_pair_t){ b, a };
+            }
+        }
+        for (int j = num_chunks - 1; j >= end; --j) {
+            for (int a = start; a < end; ++a) {
+                plan[n++] = (chunk_pair_t){ a, j };
+            }
+        }
+    }
+    *num_pairs = n;
+    return plan;
+}
+
+static void schedule_plan(chunk_schedule_t *schedule, const chunk_pair_t *plan, long int num_pairs,
+                          int num_chunks, int capacity) {
+    // next_use[2k + side]: next plan position using the chunk at that side of pair k
+    long int *next_use = (long int *)malloc((2 * num_pairs + 1) * sizeof(long int));
+    long int *upcoming = (long int *)malloc((num_chunks + 1) * sizeof(long int));
+    long int *resident_next = (long int *)malloc((num_chunks + 1) * sizeof(long int)); // -1 if not resident
+    // At most two loads per pair, and every load is released once
+    schedule->actions = (chunk_action_t *)malloc((5 * num_pairs + 1) * sizeof(chunk_action_t));
+    schedule->loads = (int *)malloc((2 * num_pairs + 1) * sizeof(int));
+    if (!next_use || !upcoming || !resident_next || !schedule->actions || !schedule->loads) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int c = 0; c < num_chunks; ++c) {
+        upcoming[c] = LONG_MAX;
+        resident_next[c] = -1;
+    }
+    for (long int k = num_pairs - 1; k >= 0; --k) {
+        next_use[2 * k] = upcoming[plan[k].i];
+        next_use[2 * k + 1] = upcoming[plan[k].j];
+        upcoming[plan[k].i] = upcoming[plan[k].j] = k;
+    }
+
+    long int n = 0;
+    int resident = 0;
+    schedule->num_loads = 0;
+    for (long int k = 0; k < num_pairs; ++k) {
+        const int chunks[2] = { plan[k].i, plan[k].j };
+        for (int side = 0; side < 2; ++side) {
+            int c = chunks[side];
+            if (resident_next[c] >= 0) {
+                continue;
+            }
+            if (resident == capacity) {
+                int victim = -1;
+                for (int r = 0; r < num_chunks; ++r) {
+                    if (resident_next[r] >= 0 && r != chunks[0] && r != chunks[1] &&
+                        (victim < 0 || resident_next[r] > resident_next[victim])) {
+                        victim = r;
+                    }
+                }
+                schedule->actions[n++] = (chunk_action_t){ ACTION_RELEASE, victim, 0 };
+                resident_next[victim] = -1;
+                resident--;
+            }
+            schedule->actions[n++] = (chunk_action_t){ ACTION_LOAD, c, 0 };
+            schedule->loads[schedule->num_loads++] = c;
+            resident_next[c] = k;
+            resident++;
+        }
+
+        schedule->actions[n++] = (chunk_action_t){ ACTION_PAIR, chunks[0], chunks[1] };
+        for (int side = 0; side < 2 - (chunks[0] == chunks[1]); ++side) {
+            int c = chunks[side];
+            resident_next[c] = next_use[2 * k + side];
+            if (resident_next[c] == LONG_MAX) {
+                schedule->actions[n++] = (chunk_action_t){ ACTION_RELEASE, c, 0 };
+                resident_next[c] = -1;
+                resident--;
+            }
+        }
+    }
+    schedule->num_actions = n;
+
+    free(next_use);
+    free(upcoming);
+    free(resident_next);
+}
+
+static void free_chunk_schedule(chunk_schedule_t *schedule) {
+    free(schedule->actions);
+    free(schedule->loads);
+}
+
+// Keeps the pairs of the plan that belong to one of num_shards shards.
+// In the order (i, i), (i, i + 1), ... the pairs are split into runs of
+// about equal numbers of cell pairs, whatever the order of the plan, so
+// every shard of a run with the same chunks gets a disjoint share.
+static long int shard_plan(chunk_pair_t *plan, long int num_pairs, const cell_source_t *src,
+                           int shard, int num_shards) {
+    int num_chunks = src->num_chunks;
+    uint64_t *row_start = (uint64_t *)malloc((num_chunks + 1) * sizeof(uint64_t));
+    long int *cells_before = (long int *)malloc((num_chunks + 1) * sizeof(long int));
+    if (!row_start || !cells_before) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cells_before[0] = 0;
+    for (int c = 0; c < num_chunks; ++c) {
+        cells_before[c + 1] = cells_before[c] + source_chunk_cells(src, c);
+    }
+    // Cell pairs in the rows of all earlier chunks
+    row_start[0] = 0;
+    for (int c = 0; c < num_chunks; ++c) {
+        uint64_t n = cells_before[c + 1] - cells_before[c];
+        row_start[c + 1] = row_start[c] + n * (n - 1) / 2 + n * (uint64_t)(src->num_cells - cells_before[c + 1]);
+    }
+    uint64_t total = row_start[num_chunks];
+    uint64_t per_shard = total / num_shards + 1;
+
+    long int kept = 0;
+    for (long int k = 0; k < num_pairs; ++k) {
+        int i = plan[k].i;
+        int j = plan[k].j;
+        uint64_t ni = cells_before[i + 1] - cells_before[i];
+        uint64_t nj = cells_before[j + 1] - cells_before[j];
+        uint64_t before = row_start[i];
+        uint64_t size = ni * (ni - 1) / 2;
+        if (j != i) {
+            before += size + ni * (uint64_t)(cells_before[j] - cells_before[i + 1]);
+            size = ni * nj;
+        }
+        // The shard holding the middle of the pair's cell pairs computes it
+        if ((before + size / 2) / per_shard == (uint64_t)shard) {
+            plan[kept++] = plan[k];
+        }
+    }
+
+    free(row_start);
+    free(cells_before);
+    return kept;
+}
+
+static void write_partial_hist(const cell_source_t *src, uint64_t checksum, int shard, int num_shards,
+                               const long int *counts, int num_bins) {
+    partial_hist_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PARTIAL_HIST_MAGIC, sizeof(header.magic));
+    header.version = PARTIAL_HIST_VERSION;
+    header.shard = shard;
+    header.num_shards = num_shards;
+    header.num_bins = num_bins;
+    header.num_cells = src->num_cells;
+    header.max_cells = src->max_cells;
+    header.bin_width = counter.width;
+    struct stat input;
+    if (stat(CELL_FILE, &input) != 0) {
+        fprintf(stderr, "Failed to open file '%s'\n", CELL_FILE);
+        exit(EXIT_FAILURE);
+    }
+    header.input_bytes = (uint64_t)input.st_size;
+    header.input_checksum = checksum;
+
+    uint64_t *partial = (uint64_t *)malloc((num_bins + 1) * sizeof(uint64_t));
+    if (!partial) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_bins; ++i) {
+        partial[i] = counts[i];
+    }
+    if (fwrite(&header, sizeof(header), 1, stdout) != 1 ||
+        fwrite(partial, sizeof(uint64_t), num_bins, stdout) != (size_t)num_bins || fflush(stdout) != 0) {
+        fprintf(stderr, "Failed to write the partial histogram\n");
+        exit(EXIT_FAILURE);
+    }
+    free(partial);
+}
+
+// The state file next to the cell file holds the histogram of its first
+// num_cells cells, with a checksum of their rows. When cells have only been
+// appended since, the next run computes the pairs involving new cells and
+// adds them to these counts.
+#define STATE_FILE CELL_FILE ".state"
+#define STATE_MAGIC "DISTSTAT"
+#define STATE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_bins;
+    uint64_t num_cells;
+    uint64_t checksum;        // Of the text of the first num_cells rows
+    uint32_t bin_width;
+    uint32_t reserved;
+} state_header_t;
 
-    return (int16_t)(sign * (integer_part * 1000 + fractional_part));
+// Position dependent checksum of the first num_rows rows of the cell file
+static uint64_t rows_checksum(const char *text, long int num_rows) {
+    const uint64_t *words = (const uint64_t *)text;
+    size_t bytes = (size_t)num_rows * row_bytes;
+    long int n = (long int)(bytes / sizeof(uint64_t));
+    uint64_t sum = 0;
+    #pragma omp parallel for reduction(+:sum) schedule(static)
+    for (long int k = 0; k < n; ++k) {
+        sum += (words[k] + 1) * (2 * (uint64_t)k + 1);
+    }
+    // Rows of other layouts need not end on a word
+    uint64_t tail = 0;
+    memcpy(&tail, text + n * sizeof(uint64_t), bytes % sizeof(uint64_t));
+    if (bytes % sizeof(uint64_t) != 0) {
+        sum += (tail + 1) * (2 * (uint64_t)n + 1);
+    }
+    return sum;
 }
 
-// Function to parse a row of coordinates
-static inline void parse_coord_row(const char *ptr, int16_t *coords) {
-    for (int i = 0; i < 3; i++) {
-        coords[i] = parse_single_coord(ptr);
-        ptr += 8; // Move past the current coordinate and the space
+// Checksum of the first num_rows rows of the cell file, mapped just for this
+static uint64_t cell_file_checksum(long int num_rows) {
+    if (num_rows == 0) {
+        return 0;
     }
+    size_t text_size;
+    const char *text = map_cell_file(CELL_FILE, &text_size);
+    uint64_t checksum = rows_checksum(text, num_rows);
+    munmap((void *)text, text_size);
+    return checksum;
 }
 
-// Function to calculate distances within a single chunk
-void calculate_distances_in_chunk(const int16_t *coords, int num_cells, long int *counts) {
-    #pragma omp parallel
-    {
-        // Allocate a private counts array for each thread
-        long int local_counts[MAX_DISTANCE_INDEX] = {0};
+// Write the parts to path.tmp, sync it and rename it over path, so path
+// always holds either the old or the new contents. Returns 0 on success.
+static int write_file_atomically(const char *path, const void *const *parts, const size_t *sizes, int num_parts) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        return -1;
+    }
+    int ok = 1;
+    for (int k = 0; k < num_parts; ++k) {
+        ok = ok && fwrite(parts[k], 1, sizes[k], file) == sizes[k];
+    }
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
 
-        #pragma omp for schedule(dynamic)
-        for (int i = 0; i < num_cells - 1; ++i) {
-            int16_t xi = coords[i * 3];
-            int16_t yi = coords[i * 3 + 1];
-            int16_t zi = coords[i * 3 + 2];
+// Add the saved counts to counts and return the number of cells they cover,
+// zero if there is no state for a prefix of the current cell file
+static long int load_state(long int num_cells, long int *counts, int num_bins) {
+    FILE *file = fopen(STATE_FILE, "rb");
+    if (!file) {
+        return 0;
+    }
+    state_header_t header;
+    uint64_t *saved = (uint64_t *)malloc((num_bins + 1) * sizeof(uint64_t));
+    if (!saved) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int valid = fread(&header, sizeof(header), 1, file) == 1 &&
+                memcmp(header.magic, STATE_MAGIC, 8) == 0 && header.version == STATE_VERSION &&
+                header.num_bins == (uint32_t)num_bins && header.bin_width == (uint32_t)counter.width &&
+                header.num_cells <= (uint64_t)num_cells &&
+                fread(saved, sizeof(uint64_t), num_bins, file) == (size_t)num_bins;
+    fclose(file);
 
-            for (int j = i + 1; j < num_cells; ++j) {
-                int16_t dx = xi - coords[j * 3];
-                int16_t dy = yi - coords[j * 3 + 1];
-                int16_t dz = zi - coords[j * 3 + 2];
+    valid = valid && cell_file_checksum((long int)header.num_cells) == header.checksum;
+    if (!valid) {
+        fprintf(stderr, "Ignoring state '%s' of other cells, counting all pairs\n", STATE_FILE);
+        free(saved);
+        return 0;
+    }
 
-                int32_t dist_sq = (int32_t)dx * dx + (int32_t)dy * dy + (int32_t)dz * dz;
-                double dist = sqrt((double)dist_sq);
+    for (int i = 0; i < num_bins; ++i) {
+        counts[i] += (long int)saved[i];
+    }
+    free(saved);
+    return (long int)header.num_cells;
+}
 
-                int16_t distance_scaled = (int16_t)(dist / 10.0 + 0.5); // Scale to two decimal places
+// Replace the state file with the counts of all num_cells cells
+static void save_state(long int num_cells, const long int *counts, int num_bins) {
+    state_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, 8);
+    header.version = STATE_VERSION;
+    header.num_bins = num_bins;
+    header.num_cells = num_cells;
+    header.checksum = cell_file_checksum(num_cells);
+    header.bin_width = counter.width;
 
-                if (distance_scaled >= 0 && distance_scaled < MAX_DISTANCE_INDEX) {
-                    local_counts[distance_scaled]++;
-                }
-            }
-        }
+    uint64_t *saved = (uint64_t *)malloc((num_bins + 1) * sizeof(uint64_t));
+    if (!saved) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_bins; ++i) {
+        saved[i] = (uint64_t)counts[i];
+    }
+    const void *parts[2] = { &header, saved };
+    size_t sizes[2] = { sizeof(header), (size_t)num_bins * sizeof(uint64_t) };
+    if (write_file_atomically(STATE_FILE, parts, sizes, 2) != 0) {
+        fprintf(stderr, "Writing state '%s' failed: %s\n", STATE_FILE, strerror(errno));
+    }
+    free(saved);
+}
 
-        // Merge local counts into global counts
-        #pragma omp critical
-        {
-            for (int k = 0; k < MAX_DISTANCE_INDEX; ++k) {
-                counts[k] += local_counts[k];
+// A checkpoint records which chunk pairs of a run are done and the counts
+// of their cell pairs, so a killed run can be resumed with --resume. It is
+// written every interval seconds, between chunk pairs, and removed when the
+// run completes. The header ties it to the cells, chunks, bins and shard.
+#define CHECKPOINT_FILE CELL_FILE ".checkpoint"
+#define CHECKPOINT_MAGIC "DISTCKPT"
+#define CHECKPOINT_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_bins;
+    uint64_t num_cells;
+    uint64_t split_cell;
+    uint32_t max_cells;
+    uint32_t num_chunks;
+    uint32_t shard;
+    uint32_t num_shards;
+    uint64_t checksum;        // Of the text of all rows
+    uint32_t bin_width;
+    uint32_t reserved;
+} checkpoint_header_t;
+
+typedef struct {
+    char path[PATH_MAX];
+    checkpoint_header_t header;
+    double interval;
+    double last_write;
+    unsigned char *done;      // By pair_index(i, j)
+    long int num_pairs;       // Entries in done
+    long int *counts;         // Counts of the pairs done before the resume
+} checkpoint_t;
+
+static long int pair_index(int i, int j) {
+    return (long int)j * (j + 1) / 2 + i;
+}
+
+static void init_checkpoint(checkpoint_t *ckpt, const cell_source_t *src, int num_output_bins,
+                            int shard, int num_shards, double interval) {
+    memset(ckpt, 0, sizeof(*ckpt));
+    if (num_shards > 0) {
+        snprintf(ckpt->path, sizeof(ckpt->path), "%s.%d", CHECKPOINT_FILE, shard);
+    } else {
+        snprintf(ckpt->path, sizeof(ckpt->path), "%s", CHECKPOINT_FILE);
+    }
+    memcpy(ckpt->header.magic, CHECKPOINT_MAGIC, 8);
+    ckpt->header.version = CHECKPOINT_VERSION;
+    ckpt->header.num_bins = num_output_bins;
+    ckpt->header.num_cells = src->num_cells;
+    ckpt->header.split_cell = src->split_cell;
+    ckpt->header.max_cells = src->max_cells;
+    ckpt->header.num_chunks = src->num_chunks;
+    ckpt->header.shard = shard;
+    ckpt->header.num_shards = num_shards;
+    ckpt->header.checksum = cell_file_checksum(src->num_cells);
+    ckpt->header.bin_width = counter.width;
+    ckpt->interval = interval;
+    ckpt->last_write = omp_get_wtime();
+    ckpt->num_pairs = pair_index(0, src->num_chunks);
+    ckpt->done = (unsigned char *)calloc(ckpt->num_pairs + 1, 1);
+    ckpt->counts = (long int *)calloc(counter.num_bins, sizeof(long int));
+    if (!ckpt->done || !ckpt->counts) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Take over the done pairs and counts of a checkpoint of the same run
+static void resume_checkpoint(checkpoint_t *ckpt) {
+    FILE *file = fopen(ckpt->path, "rb");
+    if (!file) {
+        return;
+    }
+    int num_bins = ckpt->header.num_bins;
+    checkpoint_header_t header;
+    uint64_t *saved = (uint64_t *)malloc((num_bins + 1) * sizeof(uint64_t));
+    if (!saved) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int valid = fread(&header, sizeof(header), 1, file) == 1 &&
+                memcmp(&header, &ckpt->header, sizeof(header)) == 0 &&
+                fread(ckpt->done, 1, ckpt->num_pairs, file) == (size_t)ckpt->num_pairs &&
+                fread(saved, sizeof(uint64_t), num_bins, file) == (size_t)num_bins;
+    fclose(file);
+    if (!valid) {
+        fprintf(stderr, "Ignoring checkpoint '%s' of another run\n", ckpt->path);
+        memset(ckpt->done, 0, ckpt->num_pairs);
+        free(saved);
+        return;
+    }
+    for (int i = 0; i < num_bins; ++i) {
+        ckpt->counts[i] = (long int)saved[i];
+    }
+    free(saved);
+}
+
+// Write a checkpoint if the last one is more than interval seconds old
+static void update_checkpoint(checkpoint_t *ckpt, const thread_hists_t *hists) {
+    double now = omp_get_wtime();
+    if (now - ckpt->last_write < ckpt->interval) {
+        return;
+    }
+    int num_output_bins = ckpt->header.num_bins;
+    long int *counts = (long int *)malloc(counter.num_bins * sizeof(long int));
+    uint64_t *saved = (uint64_t *)malloc((num_output_bins + 1) * sizeof(uint64_t));
+    if (!counts || !saved) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(counts, ckpt->counts, counter.num_bins * sizeof(long int));
+    pair_hists_merge(hists, counts);
+    for (int i = 0; i < num_output_bins; ++i) {
+        saved[i] = (uint64_t)counts[i];
+    }
+
+    const void *parts[3] = { &ckpt->header, ckpt->done, saved };
+    size_t sizes[3] = { sizeof(ckpt->header), (size_t)ckpt->num_pairs, (size_t)num_output_bins * sizeof(uint64_t) };
+    if (write_file_atomically(ckpt->path, parts, sizes, 3) != 0) {
+        fprintf(stderr, "Writing checkpoint '%s' failed: %s\n", ckpt->path, strerror(errno));
+    }
+    ckpt->last_write = omp_get_wtime();
+    free(counts);
+    free(saved);
+}
+
+// Add the counts from before the resume and drop the checkpoint
+static void finish_checkpoint(checkpoint_t *ckpt, long int *counts) {
+    for (int i = 0; i < counter.num_bins; ++i) {
+        counts[i] += ckpt->counts[i];
+    }
+    unlink(ckpt->path);
+    free(ckpt->done);
+    free(ckpt->counts);
+}
+
+// Throughput of every chunk pair and the progress of the run, for
+// --stats=json
+typedef struct {
+    int i;
+    int j;
+    double cell_pairs;
+    double seconds;
+} pair_stats_t;
+
+typedef struct {
+    double start;
+    pair_stats_t *pairs;
+    long int num_pairs;       // Chunk pairs done so far
+    double total_cell_pairs;  // In all chunk pairs of the plan
+    double done_cell_pairs;
+    int progress;             // Print a progress line on stderr
+    double last_progress;
+} run_stats_t;
+
+static double chunk_pair_cells(const cell_source_t *src, int i, int j) {
+    double ni = source_chunk_cells(src, i);
+    return i == j ? ni * (ni - 1) / 2 : ni * source_chunk_cells(src, j);
+}
+
+static void init_run_stats(run_stats_t *stats, const cell_source_t *src, const chunk_pair_t *plan,
+                           long int num_pairs, int progress) {
+    memset(stats, 0, sizeof(*stats));
+    stats->start = omp_get_wtime();
+    stats->progress = progress;
+    stats->pairs = (pair_stats_t *)malloc((num_pairs + 1) * sizeof(pair_stats_t));
+    if (!stats->pairs) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long int k = 0; k < num_pairs; ++k) {
+        stats->total_cell_pairs += chunk_pair_cells(src, plan[k].i, plan[k].j);
+    }
+}
+
+static void record_chunk_pair(run_stats_t *stats, const cell_source_t *src, int i, int j, double seconds) {
+    pair_stats_t *pair = &stats->pairs[stats->num_pairs++];
+    pair->i = i;
+    pair->j = j;
+    pair->cell_pairs = chunk_pair_cells(src, i, j);
+    pair->seconds = seconds;
+    stats->done_cell_pairs += pair->cell_pairs;
+
+    double now = omp_get_wtime();
+    if (stats->progress && now - stats->last_progress >= 0.5) {
+        double elapsed = now - stats->start;
+        double fraction = stats->total_cell_pairs > 0 ? stats->done_cell_pairs / stats->total_cell_pairs : 1.0;
+        fprintf(stderr, "\r%5.1f%% of cell pairs, %ld chunk pairs, %.0f s elapsed, %.0f s left ",
+                100.0 * fraction, stats->num_pairs, elapsed, elapsed / fraction - elapsed);
+        stats->last_progress = now;
+    }
+}
+
+static void print_json_seconds(const char *name, double seconds, const char *separator) {
+    fprintf(stderr, "    \"%s\": %.6f%s\n", name, seconds, separator);
+}
+
+// Write the report to stderr, hists are not merged into yet
+static void print_stats_json(const run_stats_t *stats, const cell_source_t *src, const thread_hists_t *hists,
+                             int num_hists, const char *kernel_name, long int num_loads) {
+    if (stats->progress && stats->last_progress > 0.0) {
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "{\n");
+    fprintf(stderr, "  \"kernel\": \"%s\",\n", kernel_name);
+    fprintf(stderr, "  \"engine\": \"%s\",\n", counter.tile ? "gemm" : "rows");
+    fprintf(stderr, "  \"threads\": %d,\n", hists->num_threads);
+    fprintf(stderr, "  \"numa_nodes\": %d,\n", numa.num_nodes);
+    fprintf(stderr, "  \"tile_cells\": %d,\n", counter.tile_cells);
+    fprintf(stderr, "  \"task_grain\": %d,\n", counter.task_grain);
+    fprintf(stderr, "  \"cells\": %ld,\n", src->num_cells);
+    fprintf(stderr, "  \"chunks\": %d,\n", src->num_chunks);
+    fprintf(stderr, "  \"chunk_loads\": %ld,\n", num_loads);
+    fprintf(stderr, "  \"bytes_read\": %ld,\n", src->bytes_read);
+    fprintf(stderr, "  \"cell_pairs\": %.0f,\n", stats->done_cell_pairs);
+    fprintf(stderr, "  \"seconds\": {\n");
+    print_json_seconds("total", omp_get_wtime() - stats->start, ",");
+    print_json_seconds("load_chunk", phase_times.load, ",");
+    print_json_seconds("parse", phase_times.parse, ",");
+    print_json_seconds("index", phase_times.index, ",");
+    print_json_seconds("in_chunk", phase_times.in_chunk, ",");
+    print_json_seconds("between_chunks", phase_times.between_chunks, ",");
+    print_json_seconds("merge", phase_times.merge, "");
+    fprintf(stderr, "  },\n");
+
+    // Cell pairs binned by each thread; the largest share over the mean
+    // is the imbalance
+    uint64_t max_pairs = 0;
+    uint64_t sum_pairs = 0;
+    fprintf(stderr, "  \"thread_pairs\": [");
+    for (int t = 0; t < hists->num_threads; ++t) {
+        uint64_t pairs = 0;
+        for (int h = 0; h < num_hists; ++h) {
+            for (int k = 0; k < counter.num_bins; ++k) {
+                pairs += hists[h].threads[t]->totals[k] + hists[h].threads[t]->counts[k];
             }
         }
+        max_pairs = pairs > max_pairs ? pairs : max_pairs;
+        sum_pairs += pairs;
+        fprintf(stderr, "%s%lu", t > 0 ? ", " : "", (unsigned long)pairs);
     }
+    fprintf(stderr, "],\n");
+    fprintf(stderr, "  \"thread_imbalance\": %.4f,\n",
+            sum_pairs > 0 ? (double)max_pairs * hists->num_threads / (double)sum_pairs : 1.0);
+
+    fprintf(stderr, "  \"chunk_pairs\": [");
+    for (long int k = 0; k < stats->num_pairs; ++k) {
+        const pair_stats_t *pair = &stats->pairs[k];
+        fprintf(stderr, "%s\n    {\"i\": %d, \"j\": %d, \"cell_pairs\": %.0f, \"seconds\": %.6f, \"pairs_per_second\": %.0f}",
+                k > 0 ? "," : "", pair->i, pair->j, pair->cell_pairs, pair->seconds,
+                pair->seconds > 0 ? pair->cell_pairs / pair->seconds : 0.0);
+    }
+    fprintf(stderr, "%s]\n}\n", stats->num_pairs > 0 ? "\n  " : "");
 }
 
-// Function to calculate distances between two different chunks
-void calculate_distances_between_chunks(const int16_t *coords1, const int16_t *coords2, int num_cells1, int num_cells2, long int *counts) {
-    #pragma omp parallel
-    {
-        // Allocate a private counts array for each thread
-        long int local_counts[MAX_DISTANCE_INDEX] = {0};
+// Sampling estimates the histogram from a random share of the pairs. Every
+// chunk pair is a stratum: a random subset of the cells of each chunk is
+// gathered and the pairs between the subsets are counted with the usual
+// kernels, then scaled by the stratum's pairs over its sampled pairs.
+// Pairs of the same cells are correlated, so each stratum is sampled as
+// SAMPLE_REPLICATES independent replicates, and the spread of their
+// estimates gives the variance. Each stratum draws from its own generator,
+// seeded from the seed and the chunk pair.
+#define SAMPLE_REPLICATES 8
+// 97.5% quantile of Student's t with SAMPLE_REPLICATES - 1 degrees of
+// freedom, for 95% intervals. Conservative once there are many strata.
+#define SAMPLE_T_QUANTILE 2.365
 
-        #pragma omp for schedule(dynamic)
-        for (int i = 0; i < num_cells1; ++i) {
-            int16_t xi = coords1[i * 3];
-            int16_t yi = coords1[i * 3 + 1];
-            int16_t zi = coords1[i * 3 + 2];
+typedef struct {
+    double fraction;          // Of the pairs of every stratum
+    uint64_t seed;
+    int max_cells;
+    int16_t *scratch[2];      // x, y and z of the cells sampled from either chunk
+    int *indices;
+    thread_hists_t hists;     // Of one stratum
+    long int *counts;
+    double *mean;             // Of the replicates of one stratum
+    double *sum_squares;
+    double *estimate;
+    double *variance;
+    double sampled_pairs;
+    double total_pairs;
+} pair_sampler_t;
 
-            for (int j = 0; j < num_cells2; ++j) {
-                int16_t dx = xi - coords2[j * 3];
-                int16_t dy = yi - coords2[j * 3 + 1];
-                int16_t dz = zi - coords2[j * 3 + 2];
+// splitmix64
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void init_pair_sampler(pair_sampler_t *sampler, double fraction, uint64_t seed, int max_cells) {
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->fraction = fraction;
+    sampler->seed = seed;
+    sampler->max_cells = max_cells;
+    for (int side = 0; side < 2; ++side) {
+        sampler->scratch[side] = (int16_t *)malloc((size_t)max_cells * 3 * sizeof(int16_t));
+    }
+    sampler->indices = (int *)malloc((size_t)max_cells * sizeof(int));
+    sampler->counts = (long int *)calloc(counter.num_bins, sizeof(long int));
+    sampler->mean = (double *)calloc(counter.num_bins, sizeof(double));
+    sampler->sum_squares = (double *)calloc(counter.num_bins, sizeof(double));
+    sampler->estimate = (double *)calloc(counter.num_bins, sizeof(double));
+    sampler->variance = (double *)calloc(counter.num_bins, sizeof(double));
+    if (!sampler->scratch[0] || !sampler->scratch[1] || !sampler->indices ||
+        !sampler->counts || !sampler->mean || !sampler->sum_squares || !sampler->estimate || !sampler->variance) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    pair_hists_init(&sampler->hists, omp_get_max_threads(), counter.num_bins);
+}
+
+// Gather num_samples cells of chunk, drawn without replacement, into scratch
+static chunk_coords_t sample_cells(pair_sampler_t *sampler, const chunk_coords_t *chunk, int num_samples,
+                                   int side, uint64_t *rng) {
+    int16_t *x = sampler->scratch[side];
+    int16_t *y = x + sampler->max_cells;
+    int16_t *z = y + sampler->max_cells;
+    int *indices = sampler->indices;
+    for (int k = 0; k < chunk->num_cells; ++k) {
+        indices[k] = k;
+    }
+    // Partial Fisher-Yates shuffle
+    for (int k = 0; k < num_samples; ++k) {
+        int pick = k + (int)(next_random(rng) % (uint64_t)(chunk->num_cells - k));
+        int cell = indices[pick];
+        indices[pick] = indices[k];
+        x[k] = chunk->x[cell];
+        y[k] = chunk->y[cell];
+        z[k] = chunk->z[cell];
+    }
+    chunk_coords_t sample = { .x = x, .y = y, .z = z, .num_cells = num_samples };
+    return sample;
+}
 
-                int32_t dist_sq = (int32_t)dx * dx + (int32_t)dy * dy + (int32_t)dz * dz;
-                double dist = sqrt((double)dist_sq);
+// Cells to sample from a chunk so that about fraction of the pairs are counted
+static int sample_size(int num_cells, double fraction, int minimum) {
+    int size = (int)ceil(sqrt(fraction) * num_cells);
+    size = size > minimum ? size : minimum;
+    return size < num_cells ? size : num_cells;
+}
 
-                int16_t distance_scaled = (int16_t)(dist / 10.0 + 0.5); // Scale to two decimal places
+// Count the sampled pairs of one replicate and return how many there were
+static double sample_replicate(pair_sampler_t *sampler, const chunk_coords_t *chunk1, const chunk_coords_t *chunk2,
+                               double fraction, uint64_t *rng) {
+    double sampled;
+    if (chunk1 == chunk2) {
+        int n = sample_size(chunk1->num_cells, fraction, 2);
+        chunk_coords_t sample = sample_cells(sampler, chunk1, n, 0, rng);
+        pair_count_in_chunk(&counter, &sample, &sampler->hists);
+        sampled = (double)n * (n - 1) / 2;
+    } else {
+        int n1 = sample_size(chunk1->num_cells, fraction, 1);
+        int n2 = sample_size(chunk2->num_cells, fraction, 1);
+        chunk_coords_t sample1 = sample_cells(sampler, chunk1, n1, 0, rng);
+        chunk_coords_t sample2 = sample_cells(sampler, chunk2, n2, 1, rng);
+        pair_count_between_chunks(&counter, &sample1, &sample2, NULL, &sampler->hists);
+        sampled = (double)n1 * n2;
+    }
+    memset(sampler->counts, 0, counter.num_bins * sizeof(long int));
+    pair_hists_merge(&sampler->hists, sampler->counts);
+    pair_hists_clear(&sampler->hists);
+    return sampled;
+}
 
-                if (distance_scaled >= 0 && distance_scaled < MAX_DISTANCE_INDEX) {
-                    local_counts[distance_scaled]++;
-                }
+static void sample_chunk_pair(pair_sampler_t *sampler, const chunk_coords_t *chunk1, const chunk_coords_t *chunk2,
+                              int i, int j) {
+    double total = i == j ? (double)chunk1->num_cells * (chunk1->num_cells - 1) / 2
+                          : (double)chunk1->num_cells * chunk2->num_cells;
+    if (total == 0) {
+        return;
+    }
+    uint64_t rng = sampler->seed ^ ((uint64_t)pair_index(i, j) * 0xd1b54a32d192ed03ULL);
+    if (i == j) {
+        chunk2 = chunk1;
+    }
+
+    // Counting every pair needs a single replicate
+    int replicates = sampler->fraction >= 1.0 ? 1 : SAMPLE_REPLICATES;
+    memset(sampler->mean, 0, counter.num_bins * sizeof(double));
+    memset(sampler->sum_squares, 0, counter.num_bins * sizeof(double));
+    for (int r = 0; r < replicates; ++r) {
+        double sampled = sample_replicate(sampler, chunk1, chunk2, sampler->fraction / replicates, &rng);
+        sampler->sampled_pairs += sampled;
+        // Welford's update of the mean and squared deviations
+        for (int k = 0; k < counter.num_bins; ++k) {
+            double estimate = sampler->counts[k] * (total / sampled);
+            double delta = estimate - sampler->mean[k];
+            sampler->mean[k] += delta / (r + 1);
+            sampler->sum_squares[k] += delta * (estimate - sampler->mean[k]);
+        }
+    }
+
+    for (int k = 0; k < counter.num_bins; ++k) {
+        sampler->estimate[k] += sampler->mean[k];
+        if (replicates > 1) {
+            sampler->variance[k] += sampler->sum_squares[k] / (replicates - 1) / replicates;
+        }
+    }
+    sampler->total_pairs += total;
+}
+
+static void free_pair_sampler(pair_sampler_t *sampler) {
+    free(sampler->scratch[0]);
+    free(sampler->scratch[1]);
+    free(sampler->indices);
+    free(sampler->counts);
+    free(sampler->mean);
+    free(sampler->sum_squares);
+    free(sampler->estimate);
+    free(sampler->variance);
+    pair_hists_free(&sampler->hists);
+}
+
+// With --populations the cell file holds several populations as consecutive
+// runs of rows, and there is one histogram per pair of populations, kept by
+// pair_index(p, q) with p <= q. Chunks are cut at the population boundaries
+// into segments, and every pair of segments is counted with the usual
+// kernels into the histograms of its pair. The label is thus looked up per
+// segment, and the inner loops are unchanged.
+#define MAX_POPULATIONS 16
+
+typedef struct {
+    int num_populations;
+    long int start[MAX_POPULATIONS + 1];  // First row of each population, then the number of rows
+} populations_t;
+
+// Splits the chunk starting at row first_cell into segments of one
+// population each, returns their number
+static int chunk_segments(const populations_t *pops, const chunk_coords_t *chunk, long int first_cell,
+                          chunk_coords_t *segments, int *labels) {
+    int num_segments = 0;
+    long int end_cell = first_cell + chunk->num_cells;
+    for (int p = 0; p < pops->num_populations; ++p) {
+        long int begin = pops->start[p] > first_cell ? pops->start[p] : first_cell;
+        long int end = pops->start[p + 1] < end_cell ? pops->start[p + 1] : end_cell;
+        if (begin < end) {
+            segments[num_segments] = chunk_slice(chunk, (int)(begin - first_cell), (int)(end - begin));
+            labels[num_segments++] = p;
+        }
+    }
+    return num_segments;
+}
+
+// The pairs of chunk1 (rows from first1 on) with chunk2, or within chunk1
+// if same_chunk, counted into hists[pair_index(p, q)]
+static void calculate_labeled_distances(const populations_t *pops,
+                                        const chunk_coords_t *chunk1, long int first1,
+                                        const chunk_coords_t *chunk2, long int first2,
+                                        int same_chunk, thread_hists_t *hists) {
+    chunk_coords_t segments1[MAX_POPULATIONS], segments2[MAX_POPULATIONS];
+    int labels1[MAX_POPULATIONS], labels2[MAX_POPULATIONS];
+    int n1 = chunk_segments(pops, chunk1, first1, segments1, labels1);
+    int n2 = same_chunk ? n1 : chunk_segments(pops, chunk2, first2, segments2, labels2);
+    for (int s = 0; s < n1; ++s) {
+        for (int t = same_chunk ? s : 0; t < n2; ++t) {
+            int p = labels1[s];
+            int q = same_chunk ? labels1[t] : labels2[t];
+            thread_hists_t *pair_hists = &hists[p <= q ? pair_index(p, q) : pair_index(q, p)];
+            if (same_chunk && s == t) {
+                pair_count_in_chunk(&counter, &segments1[s], pair_hists);
+            } else {
+                pair_count_between_chunks(&counter, &segments1[s], same_chunk ? &segments1[t] : &segments2[t], NULL,
+                                          pair_hists);
             }
         }
+    }
+}
 
-        // Merge local counts into global counts
-        #pragma omp critical
-        {
-            for (int k = 0; k < MAX_DISTANCE_INDEX; ++k) {
-                counts[k] += local_counts[k];
-            }   
+// A tuning profile holds the thread count, tile size and task grain that
+// ran fastest on this host. --tune measures them and saves the profile,
+// and later runs load it unless -t or the environment say otherwise. The
+// profile is $DISTANCES_PROFILE if that is set, an empty value disabling
+// it, else ~/.distances-<hostname>.profile. It is plain "key=value" text.
+typedef struct {
+    int threads;
+    int tile_cells;
+    int task_grain;
+} tuning_profile_t;
+
+// Cells on each side of the chunk pair timed by --tune
+#define TUNE_SIDE_CELLS 32768
+// A setting replaces the best one so far only if it is this much faster, so
+// timing noise does not move the profile away from the defaults
+#define TUNE_MARGIN 1.03
+
+// NULL if profiles are disabled
+static const char *profile_path(void) {
+    static char path[PATH_MAX];
+    const char *env = getenv("DISTANCES_PROFILE");
+    if (env) {
+        return *env ? env : NULL;
+    }
+    char host[256] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    const char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.distances-%s.profile", home ? home : ".", host);
+    return path;
+}
+
+// Returns 1 if a valid profile was read into profile
+static int load_profile(tuning_profile_t *profile) {
+    const char *path = profile_path();
+    FILE *file = path ? fopen(path, "r") : NULL;
+    if (!file) {
+        return 0;
+    }
+    tuning_profile_t loaded = { 0, 0, 0 };
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        int value;
+        if (sscanf(line, "threads=%d", &value) == 1) {
+            loaded.threads = value;
+        } else if (sscanf(line, "tile_cells=%d", &value) == 1) {
+            loaded.tile_cells = value;
+        } else if (sscanf(line, "task_grain=%d", &value) == 1) {
+            loaded.task_grain = value;
         }
     }
+    fclose(file);
+    if (loaded.threads < 1 || loaded.threads > MAX_THREADS || loaded.tile_cells < 16 ||
+        loaded.tile_cells > MAX_TILE_CELLS || loaded.task_grain < 1) {
+        fprintf(stderr, "Ignoring invalid tuning profile '%s'\n", path);
+        return 0;
+    }
+    *profile = loaded;
+    return 1;
+}
+
+// Pairs per second between the two halves of sample with the given
+// settings, timed over repeated passes of at least 0.2 seconds
+static double time_tuning(const chunk_coords_t *half1, const chunk_coords_t *half2, thread_hists_t *hists,
+                          const tuning_profile_t *settings) {
+    omp_set_num_threads(settings->threads);
+    pair_counter_tune(&counter, settings->tile_cells, settings->task_grain);
+
+    // One untimed pass to warm up the team and the caches
+    pair_count_between_chunks(&counter, half1, half2, NULL, hists);
+    long int passes = 0;
+    double start = omp_get_wtime();
+    double seconds;
+    do {
+        pair_count_between_chunks(&counter, half1, half2, NULL, hists);
+        ++passes;
+        seconds = omp_get_wtime() - start;
+    } while (seconds < 0.2);
+    pair_hists_clear(hists);
+
+    double rate = (double)passes * half1->num_cells * half2->num_cells / seconds;
+    fprintf(stderr, "threads=%d tile_cells=%d task_grain=%d: %.3g pairs/s\n",
+            settings->threads, settings->tile_cells, settings->task_grain, rate);
+    return rate;
 }
 
-void load_chunk(FILE *fp, int16_t *coords, int max_cells, int *cells_loaded) {
-    char coord_buffer[24];
-    *cells_loaded = 0;
+// Sweeps the thread count (unless fixed_threads is positive), then the tile
+// size, then the task grain, each with the best of the ones before, on the
+// first cells of the source, and saves the fastest settings
+static void tune_profile(cell_source_t *src, int fixed_threads) {
+    const char *path = profile_path();
+    if (!path) {
+        fprintf(stderr, "Tuning profiles are disabled by DISTANCES_PROFILE.\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t buffer_size;
+    void *buffer = alloc_coords(src->max_cells, 1, &buffer_size);
+    chunk_coords_t sample = fetch_chunk(src, 0, buffer);
+    int side = sample.num_cells / 2 < TUNE_SIDE_CELLS ? sample.num_cells / 2 : TUNE_SIDE_CELLS;
+    if (side < 1) {
+        fprintf(stderr, "Too few cells in '%s' to tune on.\n", CELL_FILE);
+        exit(EXIT_FAILURE);
+    }
+    chunk_coords_t half1 = chunk_slice(&sample, 0, side);
+    chunk_coords_t half2 = chunk_slice(&sample, side, side);
+
+    int max_threads = fixed_threads > 0 ? fixed_threads : omp_get_num_procs();
+    max_threads = max_threads < MAX_THREADS ? max_threads : MAX_THREADS;
+    thread_hists_t hists;
+    if (!pair_hists_init(&hists, max_threads, counter.num_bins)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
 
-    while (*cells_loaded < max_cells) {
-        size_t read_chars = fread(coord_buffer, sizeof(char), 24, fp);
-        if (read_chars < 24) {
-            if (feof(fp)) {
+    tuning_profile_t best = { max_threads, TILE_CELLS, 1 };
+    double best_rate = 0.0;
+    if (fixed_threads <= 0) {
+        // Powers of two, then all the processors
+        for (int threads = 1; ; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+            tuning_profile_t settings = { threads, TILE_CELLS, 1 };
+            double rate = time_tuning(&half1, &half2, &hists, &settings);
+            if (rate > best_rate * TUNE_MARGIN) {
+                best_rate = rate;
+                best = settings;
+            }
+            if (threads == max_threads) {
                 break;
-            } else {
-                fprintf(stderr, "Error reading file: %s\n", strerror(errno));
-                exit(EXIT_FAILURE);
             }
         }
-        parse_coord_row(coord_buffer, &coords[*cells_loaded * 3]);
-        (*cells_loaded)++;
     }
+    static const int tile_sizes[] = { 256, 512, 1024, 2048, 4096 };
+    tuning_profile_t base = best;
+    for (int k = 0; k < (int)(sizeof(tile_sizes) / sizeof(tile_sizes[0])) && tile_sizes[k] <= MAX_TILE_CELLS; ++k) {
+        tuning_profile_t settings = { base.threads, tile_sizes[k], 1 };
+        double rate = time_tuning(&half1, &half2, &hists, &settings);
+        if (rate > best_rate * TUNE_MARGIN) {
+            best_rate = rate;
+            best = settings;
+        }
+    }
+    static const int grains[] = { 2, 4, 8 };
+    base = best;
+    for (int k = 0; k < (int)(sizeof(grains) / sizeof(grains[0])); ++k) {
+        tuning_profile_t settings = { base.threads, base.tile_cells, grains[k] };
+        double rate = time_tuning(&half1, &half2, &hists, &settings);
+        if (rate > best_rate * TUNE_MARGIN) {
+            best_rate = rate;
+            best = settings;
+        }
+    }
+    pair_hists_free(&hists);
+    munmap(buffer, buffer_size);
+
+    char host[256] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    char text[512];
+    int length = snprintf(text, sizeof(text),
+                          "# distances tuning profile for %s, %.3g pairs/s\n"
+                          "threads=%d\ntile_cells=%d\ntask_grain=%d\n",
+                          host, best_rate, best.threads, best.tile_cells, best.task_grain);
+    const void *parts[] = { text };
+    size_t sizes[] = { (size_t)length };
+    if (write_file_atomically(path, parts, sizes, 1) != 0) {
+        fprintf(stderr, "Writing tuning profile '%s' failed: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Saved threads=%d tile_cells=%d task_grain=%d to '%s'\n",
+            best.threads, best.tile_cells, best.task_grain, path);
 }
 
 int main(int argc, char *argv[]) {
     int num_threads = 1;
-    // Parse command line arguments for number of threads
+    int width = 10; // Of the bins, in thousandths
+    const char *kernel_name = NULL;
+    int use_cache = 0;
+    int pipelined = 0;
+    double max_distance = -1.0; // Negative for the full histogram
+    int use_morton = 0;
+    int use_gemm = 0;
+    long int memory_budget = -1; // Bytes for resident chunks, negative for the default
+    int report_bytes = 0;
+    int shard = 0;
+    int num_shards = 0; // Zero unless only one shard of the chunk pairs is computed
+    int incremental = 0;
+    double checkpoint_interval = -1.0; // Seconds between checkpoints, negative for none
+    int resume = 0;
+    int stats_json = 0;
+    double sample_fraction = -1.0; // Share of the pairs to sample, negative to count all
+    double sample_error = -1.0;
+    uint64_t sample_seed = 1;
+    const char *population_sizes = NULL; // Rows of each population, NULL for an unlabeled run
+    int threads_given = 0;
+    int tune = 0;
+    // Parse command line arguments
     for (int arg = 1; arg < argc; ++arg) {
         if (strncmp(argv[arg], "-t", 2) == 0) {
             num_threads = atoi(argv[arg] + 2);
@@ -135,125 +2522,513 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Invalid number of threads. Must be between 1 and %d.\n", MAX_THREADS);
                 return EXIT_FAILURE;
             }
+            threads_given = 1;
+        } else if (strncmp(argv[arg], "-b", 2) == 0) {
+            char *end;
+            width = pair_bin_width(strtod(argv[arg] + 2, &end));
+            if (*end != '\0' || width < 0) {
+                fprintf(stderr, "Invalid bin width '%s', must be a multiple of 0.01 up to 100000.\n", argv[arg] + 2);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[arg], "-k", 2) == 0) {
+            kernel_name = argv[arg] + 2;
+        } else if (strncmp(argv[arg], "-m", 2) == 0) {
+            char *end;
+            memory_budget = strtol(argv[arg] + 2, &end, 10);
+            if (*end != '\0' || memory_budget <= 0) {
+                fprintf(stderr, "Invalid memory budget '%s'.\n", argv[arg] + 2);
+                return EXIT_FAILURE;
+            }
+            report_bytes = 1;
+        } else if (strcmp(argv[arg], "--shard") == 0 || strncmp(argv[arg], "--shard=", 8) == 0) {
+            const char *spec = argv[arg][7] == '=' ? argv[arg] + 8 : (arg + 1 < argc ? argv[++arg] : "");
+            char *end;
+            shard = (int)strtol(spec, &end, 10);
+            num_shards = *end == '/' ? (int)strtol(end + 1, &end, 10) : 0;
+            if (end == spec || *end != '\0' || num_shards <= 0 || shard < 0 || shard >= num_shards) {
+                fprintf(stderr, "Invalid shard '%s', expected k/N with 0 <= k < N.\n", spec);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[arg], "--checkpoint") == 0) {
+            checkpoint_interval = 600.0;
+        } else if (strncmp(argv[arg], "--checkpoint=", 13) == 0) {
+            char *end;
+            checkpoint_interval = strtod(argv[arg] + 13, &end);
+            if (*end != '\0' || !(checkpoint_interval >= 0.0)) {
+                fprintf(stderr, "Invalid checkpoint interval '%s'.\n", argv[arg] + 13);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[arg], "--stats=", 8) == 0) {
+            if (strcmp(argv[arg] + 8, "json") != 0) {
+                fprintf(stderr, "Unknown stats format '%s'.\n", argv[arg] + 8);
+                return EXIT_FAILURE;
+            }
+            stats_json = 1;
+        } else if (strncmp(argv[arg], "--sample=", 9) == 0) {
+            char *end;
+            sample_fraction = strtod(argv[arg] + 9, &end);
+            if (*end != '\0' || !(sample_fraction > 0.0 && sample_fraction <= 1.0)) {
+                fprintf(stderr, "Invalid sample fraction '%s', must be in (0, 1].\n", argv[arg] + 9);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[arg], "--error=", 8) == 0) {
+            char *end;
+            sample_error = strtod(argv[arg] + 8, &end);
+            if (*end != '\0' || !(sample_error > 0.0)) {
+                fprintf(stderr, "Invalid error '%s'.\n", argv[arg] + 8);
+                return EXIT_FAILURE;
+            }
+        } else if (strncmp(argv[arg], "--seed=", 7) == 0) {
+            sample_seed = strtoull(argv[arg] + 7, NULL, 10);
+        } else if (strcmp(argv[arg], "--tune") == 0) {
+            tune = 1;
+        } else if (strcmp(argv[arg], "--resume") == 0) {
+            resume = 1;
+        } else if (strcmp(argv[arg], "--incremental") == 0) {
+            incremental = 1;
+        } else if (strcmp(argv[arg], "--cache") == 0) {
+            use_cache = 1;
+        } else if (strcmp(argv[arg], "--pipeline") == 0) {
+            pipelined = 1;
+        } else if (strncmp(argv[arg], "--populations=", 14) == 0) {
+            population_sizes = argv[arg] + 14;
+        } else if (strcmp(argv[arg], "--numa") == 0) {
+            numa.enabled = 1;
+        } else if (strncmp(argv[arg], "--numa=", 7) == 0) {
+            // Comma-separated options on top of pinning and first touch
+            numa.enabled = 1;
+            for (const char *option = argv[arg] + 7; *option; ) {
+                size_t length = strcspn(option, ",");
+                if (length == 9 && strncmp(option, "replicate", 9) == 0) {
+                    numa.replicate = 1;
+                } else if (length == 9 && strncmp(option, "hugepages", 9) == 0) {
+                    numa.huge_pages = 1;
+                } else {
+                    fprintf(stderr, "Unknown NUMA option '%.*s', expected replicate or hugepages.\n", (int)length, option);
+                    return EXIT_FAILURE;
+                }
+                option += length + (option[length] == ',');
+            }
+        } else if (strcmp(argv[arg], "--morton") == 0) {
+            use_morton = 1;
+        } else if (strcmp(argv[arg], "--gemm") == 0) {
+            use_gemm = 1;
+        } else if (strncmp(argv[arg], "--max-distance=", 15) == 0) {
+            char *end;
+            max_distance = strtod(argv[arg] + 15, &end);
+            if (*end != '\0' || !(max_distance >= 0.0)) {
+                fprintf(stderr, "Invalid maximum distance '%s'.\n", argv[arg] + 15);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    if (use_morton && max_distance >= 0.0) {
+        fprintf(stderr, "--morton and --max-distance cannot be combined.\n");
+        return EXIT_FAILURE;
+    }
+    if (use_gemm && (use_morton || max_distance >= 0.0)) {
+        fprintf(stderr, "--gemm cannot be combined with --morton or --max-distance.\n");
+        return EXIT_FAILURE;
+    }
+    if (resume && checkpoint_interval < 0.0) {
+        checkpoint_interval = 600.0;
+    }
+    int sampling = sample_fraction > 0.0 || sample_error > 0.0;
+    if (sampling && (num_shards > 0 || incremental || checkpoint_interval >= 0.0)) {
+        fprintf(stderr, "Sampling cannot be combined with --shard, --incremental or checkpoints.\n");
+        return EXIT_FAILURE;
+    }
+    int labeled = population_sizes != NULL;
+    if (labeled && (sampling || num_shards > 0 || incremental || checkpoint_interval >= 0.0 ||
+                    use_morton || max_distance >= 0.0)) {
+        fprintf(stderr, "--populations cannot be combined with sampling, --shard, --incremental, checkpoints, "
+                        "--morton or --max-distance.\n");
+        return EXIT_FAILURE;
+    }
+    if (incremental && num_shards > 0) {
+        fprintf(stderr, "--incremental and --shard cannot be combined.\n");
+        return EXIT_FAILURE;
+    }
+
+    // The tuning profile of this host, if any, sets the defaults
+    tuning_profile_t profile = { num_threads, TILE_CELLS, 1 };
+    if (!tune && load_profile(&profile)) {
+        if (!threads_given) {
+            num_threads = profile.threads;
         }
+        profile.tile_cells = profile.tile_cells < MAX_TILE_CELLS ? profile.tile_cells : MAX_TILE_CELLS;
+        fprintf(stderr, "Using tuning profile '%s': threads=%d%s tile_cells=%d task_grain=%d\n",
+                profile_path(), num_threads, threads_given ? " (from -t)" : "", profile.tile_cells, profile.task_grain);
     }
 
     omp_set_num_threads(num_threads);
+    if (numa.enabled) {
+        init_numa(num_threads);
+    }
+
+    // Open file "cells", or its cache. Its bounding box sets the bins.
+    cell_source_t src;
+    open_cell_source(&src, use_cache);
+    if (wide_coords && (max_distance >= 0.0 || use_morton || sampling || use_gemm)) {
+        fprintf(stderr, "Cells that need wide coordinates cannot be used with --max-distance, --morton, "
+                        "sampling or --gemm.\n");
+        return EXIT_FAILURE;
+    }
+    numa.replicate = numa.replicate && !wide_coords;
+    if (memory_budget < 0) {
+        memory_budget = 4200000;
+    }
+    // The bins reach the diagonal of the bounding box, so no pair is lost,
+    // however large the box of wide cells is. They are not part of the
+    // memory budget, which only bounds the chunks.
+    if (!pair_counter_init(&counter, width, max_dist_sq, wide_coords)) {
+        fprintf(stderr, "Bins of width %d are too narrow for the bin tables, or too many, or memory ran out\n",
+                width);
+        return EXIT_FAILURE;
+    }
+    // Each bin takes a 32-bit count and a 64-bit total in every thread's
+    // histogram and a final count
+    double hist_bytes = (double)counter.num_bins *
+                        (num_threads * (sizeof(uint32_t) + sizeof(uint64_t)) + sizeof(long int));
+    if (hist_bytes > (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE)) {
+        fprintf(stderr, "The %d bins up to the diagonal of the cells need %.0f MiB, more than the memory of "
+                        "this machine. Use wider bins with -b.\n", counter.num_bins, hist_bytes / (1 << 20));
+        return EXIT_FAILURE;
+    }
+    pair_counter_tune(&counter, profile.tile_cells, profile.task_grain);
+
+    // Pick the pair kernel once, based on what the CPU supports. Wide
+    // coordinates always go through the scalar wide kernel.
+    if (!pair_counter_select(&counter, kernel_name, use_gemm)) {
+        fprintf(stderr, "Pair kernel '%s' is unknown or not supported by this CPU.\n", kernel_name);
+        return EXIT_FAILURE;
+    }
 
     // Determine maximum cells per chunk to limit memory usage
-    // Each cell has 3 int16_t, so 6 bytes. We use two chunks in memory at a time
-    // Total memory for coordinates: 2 * MAX_CELLS_PER_CHUNK * 3 * sizeof(int16_t)
-    // Let total memory <= 4 MiB to leave space for counts and other allocations
-    const int MAX_CELLS_PER_CHUNK = 350000; // 350,000 cells -> 4,200,000 bytes
-
-    // Allocate memory for two chunks
-    int16_t *coords1 = (int16_t *)malloc(MAX_CELLS_PER_CHUNK * 3 * sizeof(int16_t));
-    int16_t *coords2 = (int16_t *)malloc(MAX_CELLS_PER_CHUNK * 3 * sizeof(int16_t));
-    if (!coords1 || !coords2) {
-        fprintf(stderr, "Memory allocation failed\n");
-        free(coords1);
-        free(coords2);
+    // Each cell has 3 int16_t (x, y and z arrays), so 6 bytes, 12 with wide coordinates. At least two chunks are in memory at
+    // a time, three when pipelined, so the chunks shrink to keep within the budget. A larger budget
+    // keeps more chunks of at most 350,000 cells resident instead, so fewer chunks are read again
+    // Default budget: 4,200,000 = 2 * 350,000 * 3 * sizeof(int16_t), leaving space for counts and
+    // other allocations within 5 MiB
+    const long int CELL_BYTES = 3 * coord_bytes;
+    long int max_cells = memory_budget / ((2 + pipelined) * CELL_BYTES);
+    max_cells = max_cells < 350000 ? max_cells : 350000;
+    if (max_cells < 1) {
+        fprintf(stderr, "Memory budget of %ld bytes is too small.\n", memory_budget);
         return EXIT_FAILURE;
     }
+    const int MAX_CELLS_PER_CHUNK = (int)max_cells;
+
+    // With a maximum distance only the bins that lie entirely below it are
+    // computed and printed: bin b ends at (b + 1/2) * width thousandths
+    int num_output_bins = counter.num_bins;
+    int grid_side = 0;
+    if (max_distance >= 0.0) {
+        int cutoff = (int)(max_distance * 1000.0 + 0.5);
+        num_output_bins = 2 * cutoff >= width ? (2 * cutoff - width) / (2 * width) + 1 : 0;
+        num_output_bins = num_output_bins < counter.num_bins ? num_output_bins : counter.num_bins;
+        grid_side = cutoff > 1 ? cutoff : 1;
+    }
+    // Sampled cells go through the plain kernels
+    if (sampling) {
+        grid_side = 0;
+        use_morton = 0;
+    }
+
+    // Split the cells into chunks
+    chunk_cell_source(&src, MAX_CELLS_PER_CHUNK);
+    if (tune) {
+        tune_profile(&src, threads_given ? num_threads : 0);
+        close_cell_source(&src);
+        return EXIT_SUCCESS;
+    }
+
+    // The rows left after the given populations are one more population
+    populations_t pops = { 0 };
+    int num_hists = 1;
+    if (labeled) {
+        const char *size = population_sizes;
+        for (;;) {
+            char *end;
+            long int rows = strtol(size, &end, 10);
+            if (end == size || rows <= 0 || pops.num_populations == MAX_POPULATIONS ||
+                rows > src.num_cells - pops.start[pops.num_populations] || (*end != ',' && *end != '\0')) {
+                fprintf(stderr, "Invalid populations '%s', expected up to %d row counts that fit in '%s'.\n",
+                        population_sizes, MAX_POPULATIONS, CELL_FILE);
+                return EXIT_FAILURE;
+            }
+            pops.start[pops.num_populations + 1] = pops.start[pops.num_populations] + rows;
+            pops.num_populations++;
+            if (*end == '\0') {
+                break;
+            }
+            size = end + 1;
+        }
+        if (pops.start[pops.num_populations] < src.num_cells) {
+            if (pops.num_populations == MAX_POPULATIONS) {
+                fprintf(stderr, "At most %d populations are supported.\n", MAX_POPULATIONS);
+                return EXIT_FAILURE;
+            }
+            pops.start[++pops.num_populations] = src.num_cells;
+        }
+        num_hists = (int)pair_index(0, pops.num_populations);
+    }
 
-    // Initialize global counts
-    long int *final_counts = (long int *)calloc(MAX_DISTANCE_INDEX, sizeof(long int));
+    // Initialize global counts, one per bin for each histogram
+    long int *final_counts = (long int *)calloc((size_t)num_hists * counter.num_bins, sizeof(long int));
     if (!final_counts) {
         fprintf(stderr, "Memory allocation failed\n");
-        free(coords1);
-        free(coords2);
         return EXIT_FAILURE;
     }
 
-    // Open file "cells" for reading
-    FILE *fp = fopen(CELL_FILE, "r");
-    if (!fp) {
-        fprintf(stderr, "Failed to open file '%s'\n", CELL_FILE);
-        free(coords1);
-        free(coords2);
-        free(final_counts);
-        return EXIT_FAILURE;
+    // Incrementally only the pairs with a cell appended since the saved
+    // state are computed, in chunks that start at the first new cell
+    long int old_cells = 0;
+    if (incremental) {
+        old_cells = load_state(src.num_cells, final_counts, num_output_bins);
+        split_cell_source(&src, old_cells);
     }
+    int num_chunks = src.num_chunks;
 
-    // Determine file size
-    if (fseek(fp, 0L, SEEK_END) != 0) {
-        fprintf(stderr, "fseek failed\n");
-        fclose(fp);
-        free(coords1);
-        free(coords2);
-        free(final_counts);
-        return EXIT_FAILURE;
+    // --error=eps bounds the 95% interval of each bin's share of all pairs
+    // by eps. A share p estimated from m pairs has a standard error of at
+    // most 0.5 / sqrt(m), so m = (1.96 * 0.5 / eps)^2 pairs suffice.
+    pair_sampler_t sampler;
+    if (sampling) {
+        if (sample_fraction < 0.0) {
+            double all_pairs = (double)src.num_cells * (src.num_cells - 1) / 2;
+            double needed = (0.98 / sample_error) * (0.98 / sample_error);
+            sample_fraction = all_pairs > needed ? needed / all_pairs : 1.0;
+        }
+        init_pair_sampler(&sampler, sample_fraction, sample_seed, MAX_CELLS_PER_CHUNK);
     }
 
-    long int file_size = ftell(fp);
-    if (file_size == -1L) {
-        fprintf(stderr, "ftell failed\n");
-        fclose(fp);
-        free(coords1);
-        free(coords2);
-        free(final_counts);
+    // Resident chunks, one buffer each, plus the one the loader thread fills
+    int capacity = (int)(memory_budget / (max_cells * CELL_BYTES)) - pipelined;
+    int max_capacity = num_chunks > 2 ? num_chunks : 2;
+    capacity = capacity < max_capacity ? capacity : max_capacity;
+
+    long int num_pairs;
+    chunk_pair_t *plan = block_plan(num_chunks, capacity, &num_pairs);
+    if (num_shards > 0) {
+        num_pairs = shard_plan(plan, num_pairs, &src, shard, num_shards);
+    }
+    if (old_cells > 0) {
+        long int kept = 0;
+        for (long int k = 0; k < num_pairs; ++k) {
+            if (plan[k].j >= src.split_chunk) {
+                plan[kept++] = plan[k];
+            }
+        }
+        num_pairs = kept;
+    }
+
+    // Resuming skips the pairs a checkpoint of the same run has done
+    checkpoint_t ckpt;
+    int checkpointing = checkpoint_interval >= 0.0;
+    if (checkpointing) {
+        init_checkpoint(&ckpt, &src, num_output_bins, shard, num_shards, checkpoint_interval);
+        if (resume) {
+            resume_checkpoint(&ckpt);
+            long int kept = 0;
+            for (long int k = 0; k < num_pairs; ++k) {
+                if (!ckpt.done[pair_index(plan[k].i, plan[k].j)]) {
+                    plan[kept++] = plan[k];
+                }
+            }
+            num_pairs = kept;
+        }
+    }
+    chunk_schedule_t schedule;
+    schedule_plan(&schedule, plan, num_pairs, num_chunks, capacity);
+
+    // The progress line is only for a terminal
+    run_stats_t stats;
+    init_run_stats(&stats, &src, plan, num_pairs, stats_json && isatty(STDERR_FILENO));
+    free(plan);
+
+    thread_hists_t *hists = (thread_hists_t *)malloc(num_hists * sizeof(thread_hists_t));
+    if (!hists) {
+        fprintf(stderr, "Memory allocation failed\n");
         return EXIT_FAILURE;
     }
-    fseek(fp, 0L, SEEK_SET);
-
-    // Calculate number of chunks
-    int num_chunks = (file_size + (24 * MAX_CELLS_PER_CHUNK) - 1) / (24 * MAX_CELLS_PER_CHUNK);
-    int last_chunk_size = (file_size % (24 * MAX_CELLS_PER_CHUNK)) / 24;
-    if (last_chunk_size == 0 && num_chunks > 0) {
-        last_chunk_size = MAX_CELLS_PER_CHUNK;
-    }
-
-    // Loop through each chunk
-    for (int i = 0; i < num_chunks; i++) {
-        // Determine current chunk size
-        int current_chunk_size = (i == num_chunks - 1) ? last_chunk_size : MAX_CELLS_PER_CHUNK;
-
-        // Load chunk i into coords1
-        fseek(fp, i * 24 * MAX_CELLS_PER_CHUNK, SEEK_SET);
-        int cells_loaded1;
-        load_chunk(fp, coords1, current_chunk_size, &cells_loaded1);
-        if (cells_loaded1 != current_chunk_size) {
-            fprintf(stderr, "Unexpected number of cells loaded for chunk %d\n", i);
-            fclose(fp);
-            free(coords1);
-            free(coords2);
-            free(final_counts);
+    for (int h = 0; h < num_hists; ++h) {
+        if (!pair_hists_init(&hists[h], omp_get_max_threads(), counter.num_bins)) {
+            fprintf(stderr, "Memory allocation failed\n");
             return EXIT_FAILURE;
         }
+    }
 
-        // Calculate distances within chunk i
-        calculate_distances_in_chunk(coords1, current_chunk_size, final_counts);
+    // A grid or Morton blocks are built once per load of a chunk and kept
+    // while it is resident
+    typedef struct {
+        int buffer;
+        chunk_coords_t coords;
+        cell_grid_t grid;
+        morton_blocks_t blocks;
+    } resident_chunk_t;
+    resident_chunk_t *resident = (resident_chunk_t *)malloc((num_chunks + 1) * sizeof(resident_chunk_t));
+    if (!resident) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
 
-        // Calculate distances between chunk i and all subsequent chunks
-        for (int j = i + 1; j < num_chunks; j++) {
-            int chunk_j_size = (j == num_chunks - 1) ? last_chunk_size : MAX_CELLS_PER_CHUNK;
+    chunk_loader_t loader;
+    start_chunk_loader(&loader, &src, schedule.loads, schedule.num_loads, capacity + pipelined, pipelined);
+    chunk_replicas_t replicas;
+    int replicate = numa.replicate && numa.num_nodes > 1 && grid_side == 0 && !use_morton && !sampling && !labeled;
+    if (replicate) {
+        init_chunk_replicas(&replicas, MAX_CELLS_PER_CHUNK);
+    }
+    double start;
 
-            // Load chunk j into coords2
-            fseek(fp, j * 24 * MAX_CELLS_PER_CHUNK, SEEK_SET);
-            int cells_loaded2;
-            load_chunk(fp, coords2, chunk_j_size, &cells_loaded2);
-            if (cells_loaded2 != chunk_j_size) {
-                fprintf(stderr, "Unexpected number of cells loaded for chunk %d\n", j);
-                fclose(fp);
-                free(coords1);
-                free(coords2);
-                free(final_counts);
-                return EXIT_FAILURE;
+    for (long int a = 0; a < schedule.num_actions; ++a) {
+        const chunk_action_t *action = &schedule.actions[a];
+        resident_chunk_t *chunk1 = &resident[action->chunk];
+        if (action->type == ACTION_LOAD) {
+            chunk1->coords = next_chunk(&loader, &chunk1->buffer);
+            start = omp_get_wtime();
+            if (grid_side > 0) {
+                build_cell_grid(&chunk1->grid, &chunk1->coords, grid_side);
+            } else if (use_morton) {
+                build_morton_blocks(&chunk1->blocks, &chunk1->coords);
+            }
+            phase_times.index += omp_get_wtime() - start;
+        } else if (action->type == ACTION_RELEASE) {
+            if (grid_side > 0) {
+                free_cell_grid(&chunk1->grid);
+            } else if (use_morton) {
+                free_morton_blocks(&chunk1->blocks);
+            }
+            release_chunk(&loader, chunk1->buffer);
+        } else if (sampling) {
+            start = omp_get_wtime();
+            sample_chunk_pair(&sampler, &chunk1->coords, &resident[action->other].coords, action->chunk, action->other);
+            record_chunk_pair(&stats, &src, action->chunk, action->other, omp_get_wtime() - start);
+        } else if (action->other == action->chunk) {
+            // Calculate distances within the chunk
+            start = omp_get_wtime();
+            if (labeled) {
+                long int first_cell = chunk_first_cell(&src, action->chunk);
+                calculate_labeled_distances(&pops, &chunk1->coords, first_cell, &chunk1->coords, first_cell, 1, hists);
+            } else if (grid_side > 0) {
+                calculate_distances_in_grid(&chunk1->grid, hists);
+            } else if (use_morton) {
+                calculate_distances_in_blocks(&chunk1->blocks, hists);
+            } else {
+                pair_count_in_chunk(&counter, &chunk1->coords, hists);
+            }
+            phase_times.in_chunk += omp_get_wtime() - start;
+            record_chunk_pair(&stats, &src, action->chunk, action->chunk, omp_get_wtime() - start);
+        } else {
+            // Calculate distances between the two chunks
+            resident_chunk_t *chunk2 = &resident[action->other];
+            start = omp_get_wtime();
+            if (labeled) {
+                calculate_labeled_distances(&pops, &chunk1->coords, chunk_first_cell(&src, action->chunk),
+                                            &chunk2->coords, chunk_first_cell(&src, action->other), 0, hists);
+            } else if (grid_side > 0) {
+                calculate_distances_between_grids(&chunk1->grid, &chunk2->grid, hists);
+            } else if (use_morton) {
+                calculate_distances_between_blocks(&chunk1->blocks, &chunk2->blocks, hists);
+            } else {
+                const chunk_coords_t *inner = &chunk2->coords;
+                if (replicate) {
+                    inner = replicate_chunk(&replicas, action->other, inner, MAX_CELLS_PER_CHUNK);
+                }
+                pair_count_between_chunks(&counter, &chunk1->coords, inner, replicate ? numa.thread_node : NULL,
+                                          hists);
             }
+            phase_times.between_chunks += omp_get_wtime() - start;
+            record_chunk_pair(&stats, &src, action->chunk, action->other, omp_get_wtime() - start);
+        }
+        if (checkpointing && action->type == ACTION_PAIR) {
+            ckpt.done[pair_index(action->chunk, action->other)] = 1;
+            update_checkpoint(&ckpt, hists);
+        }
+    }
+
+    stop_chunk_loader(&loader);
+    if (replicate) {
+        free_chunk_replicas(&replicas);
+    }
+    if (report_bytes && !stats_json) {
+        fprintf(stderr, "Read %ld bytes in %ld chunk loads of %d chunks (%d resident)\n",
+                src.bytes_read, schedule.num_loads, num_chunks, capacity);
+    }
+    close_cell_source(&src);
+    free(resident);
+
+    start = omp_get_wtime();
+    for (int h = 0; h < num_hists; ++h) {
+        pair_hists_merge(&hists[h], final_counts + (long int)h * counter.num_bins);
+    }
+    phase_times.merge += omp_get_wtime() - start;
+    if (stats_json) {
+        print_stats_json(&stats, &src, hists, num_hists, wide_coords ? "wide" : counter.kernel_name, schedule.num_loads);
+    }
+    free(stats.pairs);
+    for (int h = 0; h < num_hists; ++h) {
+        pair_hists_free(&hists[h]);
+    }
+    free(hists);
+    free_chunk_schedule(&schedule);
+    if (checkpointing) {
+        finish_checkpoint(&ckpt, final_counts);
+    }
+    if (incremental) {
+        save_state(src.num_cells, final_counts, num_output_bins);
+    }
+
+    const double bin_size = width / 1000.0;
 
-            // Calculate distances between chunk i and chunk j
-            calculate_distances_between_chunks(coords1, coords2, current_chunk_size, chunk_j_size, final_counts);
+    // Estimates are printed with the bounds of their 95% confidence interval
+    if (sampling) {
+        fprintf(stderr, "Sampled %.0f of %.0f pairs (%.4g%%)\n", sampler.sampled_pairs, sampler.total_pairs,
+                sampler.total_pairs > 0 ? 100.0 * sampler.sampled_pairs / sampler.total_pairs : 100.0);
+        for (int i = 0; i < num_output_bins; ++i) {
+            long int estimate = lround(sampler.estimate[i]);
+            if (estimate > 0) {
+                double half_width = SAMPLE_T_QUANTILE * sqrt(sampler.variance[i]);
+                long int low = lround(sampler.estimate[i] - half_width);
+                printf("%05.2f %ld %ld %ld\n", i * bin_size, estimate, low > 0 ? low : 0,
+                       lround(sampler.estimate[i] + half_width));
+            }
         }
+        free_pair_sampler(&sampler);
+        free(final_counts);
+        return EXIT_SUCCESS;
     }
 
-    fclose(fp);
-    free(coords2);
-    free(coords1);
+    // A shard leaves the output to distances-merge
+    if (num_shards > 0) {
+        write_partial_hist(&src, cell_file_checksum(src.num_cells), shard, num_shards, final_counts,
+                           num_output_bins);
+        free(final_counts);
+        return EXIT_SUCCESS;
+    }
+
+    // One histogram per population pair, each line led by the pair
+    if (labeled) {
+        for (int p = 0; p < pops.num_populations; ++p) {
+            for (int q = p; q < pops.num_populations; ++q) {
+                const long int *counts = final_counts + pair_index(p, q) * counter.num_bins;
+                for (int i = 0; i < num_output_bins; ++i) {
+                    if (counts[i] > 0) {
+                        printf("%d %d %05.2f %ld\n", p, q, i * bin_size, counts[i]);
+                    }
+                }
+            }
+        }
+        free(final_counts);
+        return EXIT_SUCCESS;
+    }
 
     // Output distances and counts in sorted order
-    for (int i = 0; i < MAX_DISTANCE_INDEX; ++i) {
+    for (int i = 0; i < num_output_bins; ++i) {
         if (final_counts[i] > 0) {
-            double distance = i * 0.01; // Convert back to actual distance
+            double distance = i * bin_size; // Convert back to actual distance
             printf("%05.2f %ld\n", distance, final_counts[i]);
         }
     }
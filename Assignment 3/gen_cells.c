@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+// Writes a cell file of num_cells rows "sDD.DDD sDD.DDD sDD.DDD\n" to stdout,
+// with coordinates in [-10, 10]. The same seed gives the same file on any
+// machine. Clustered cells are normally distributed around a few random
+// centres, which gives the histogram a very different shape from uniform
+// cells.
+#define COORD_MAX 10000  // In thousandths
+#define NUM_CLUSTERS 16
+#define CLUSTER_SIGMA 500.0
+#define ROWS_PER_WRITE 4096
+
+static uint64_t rng_state;
+
+// splitmix64
+static uint64_t next_random(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double next_uniform(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int uniform_coord(void) {
+    return (int)(next_random() % (2 * COORD_MAX + 1)) - COORD_MAX;
+}
+
+// Box-Muller, clamped to the valid range
+static int clustered_coord(int centre) {
+    double u = 1.0 - next_uniform();
+    double v = next_uniform();
+    double offset = CLUSTER_SIGMA * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+    long int coord = lround(centre + offset);
+    return (int)(coord < -COORD_MAX ? -COORD_MAX : coord > COORD_MAX ? COORD_MAX : coord);
+}
+
+static void format_coord(char *out, int coord) {
+    out[0] = coord < 0 ? '-' : '+';
+    coord = abs(coord);
+    out[1] = '0' + coord / 10000;
+    out[2] = '0' + coord / 1000 % 10;
+    out[3] = '.';
+    out[4] = '0' + coord / 100 % 10;
+    out[5] = '0' + coord / 10 % 10;
+    out[6] = '0' + coord % 10;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s num_cells [seed] [uniform|clustered]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    char *end;
+    long int num_cells = strtol(argv[1], &end, 10);
+    if (*end != '\0' || num_cells < 0) {
+        fprintf(stderr, "Invalid number of cells '%s'.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    rng_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    int clustered = 0;
+    if (argc > 3) {
+        if (strcmp(argv[3], "clustered") == 0) {
+            clustered = 1;
+        } else if (strcmp(argv[3], "uniform") != 0) {
+            fprintf(stderr, "Unknown distribution '%s'.\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int centres[NUM_CLUSTERS][3];
+    for (int c = 0; c < NUM_CLUSTERS; ++c) {
+        for (int axis = 0; axis < 3; ++axis) {
+            centres[c][axis] = uniform_coord();
+        }
+    }
+
+    static char buffer[ROWS_PER_WRITE * 24];
+    for (long int first = 0; first < num_cells; first += ROWS_PER_WRITE) {
+        int rows = num_cells - first < ROWS_PER_WRITE ? (int)(num_cells - first) : ROWS_PER_WRITE;
+        for (int r = 0; r < rows; ++r) {
+            char *row = buffer + r * 24;
+            const int *centre = clustered ? centres[next_random() % NUM_CLUSTERS] : NULL;
+            for (int axis = 0; axis < 3; ++axis) {
+                format_coord(row + axis * 8, clustered ? clustered_coord(centre[axis]) : uniform_coord());
+                row[axis * 8 + 7] = axis < 2 ? ' ' : '\n';
+            }
+        }
+        if (fwrite(buffer, 24, rows, stdout) != (size_t)rows) {
+            fprintf(stderr, "Failed to write cells\n");
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
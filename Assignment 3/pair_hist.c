@@ -0,0 +1,851 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include <math.h>
+#include <stdint.h>
+#include <limits.h>
+#include <immintrin.h>
+#include "pair_hist.h"
+#include "pair_kernels.h"
+
+// Squared distances are binned with integer operations only. With bins w
+// thousandths wide, bin b holds round(sqrt(dist_sq) / w) == b, i.e. dist_sq
+// in [(wb - w/2)^2, (wb + w/2)^2), which is exactly what the
+// sqrt/divide/round of the original kernels gives for w = 10: sqrt and the
+// division are correctly rounded, so a squared distance on a boundary
+// rounds up and the others stay far from it. The bins reach up to the
+// diagonal of the bounding box of the cells, so no pair is dropped.
+//
+// A coarse table maps the top key_bits + 1 significant bits of dist_sq to
+// the lowest bin in that range. key_bits is the smallest of
+// KEY_BITS_VARIANTS for which no range spans two bin boundaries, so one
+// compare against the upper bound of that bin finishes the lookup. Coarser
+// bins get by with fewer key bits, so besides fewer counts they get a
+// smaller table: 88 KiB for 0.01 bins, under 6 KiB from 0.1 on.
+//
+// Wide squared distances need 64 bits. Their kernel estimates the bin with
+// a double sqrt and corrects it by one compare each way against
+// wide_upper.
+#define KEY_TABLE_SIZE(key_bits) ((32 - (key_bits) + 1) << (key_bits))
+#define MAX_KEY_BITS 11
+// Compact squared distances are below 2^31, so this bounds their bins
+#define MAX_COMPACT_BINS 4636
+
+// Bucket of dist_sq in the key table: exact below 2^(key_bits + 1), then
+// key_bits bits below the leading one
+static inline uint32_t bin_key(uint32_t dist_sq, int key_bits) {
+    int shift = 31 - __builtin_clz(dist_sq | 1) - key_bits;
+    if (shift < 0) {
+        shift = 0;
+    }
+    return (dist_sq >> shift) + ((uint32_t)shift << key_bits);
+}
+
+static inline int dist_sq_to_bin_bits(const pair_counter_t *pc, uint32_t dist_sq, int key_bits) {
+    if (dist_sq > pc->clamp) {
+        dist_sq = pc->clamp;
+    }
+    int bin = pc->key_table[bin_key(dist_sq, key_bits)];
+    return bin + ((int32_t)dist_sq > pc->upper[bin]);
+}
+
+int pair_counter_bin(const pair_counter_t *pc, uint32_t dist_sq) {
+    return dist_sq_to_bin_bits(pc, dist_sq, pc->key_bits);
+}
+
+// Fill the key table for key_bits, returns 0 if some key range spans two
+// bin boundaries
+static int build_bin_key_table(pair_counter_t *pc, int key_bits) {
+    int bin = 0;
+    int valid = 1;
+    for (uint32_t key = 0; key < (uint32_t)KEY_TABLE_SIZE(key_bits); ++key) {
+        // Smallest and largest dist_sq that map to this key
+        uint32_t shift = key < (2u << key_bits) ? 0 : (key >> key_bits) - 1;
+        uint64_t lowest = (uint64_t)(key - (shift << key_bits)) << shift;
+        uint64_t highest = lowest + (1ull << shift) - 1;
+        while (bin < pc->num_bins && lowest > (uint64_t)pc->upper[bin]) {
+            ++bin;
+        }
+        pc->key_table[key] = (uint16_t)bin;
+        if (lowest <= pc->clamp && bin + 1 < pc->num_bins &&
+            (highest < pc->clamp ? highest : pc->clamp) > (uint64_t)pc->upper[bin + 1]) {
+            valid = 0;
+        }
+    }
+    pc->key_table[KEY_TABLE_SIZE(key_bits)] = pc->key_table[KEY_TABLE_SIZE(key_bits) + 1] = (uint16_t)pc->num_bins;
+    return valid;
+}
+
+// The pair kernels are instantiated for each of these key widths
+#define KEY_BITS_VARIANTS(X) X(11) X(9) X(7) X(5)
+#define KEY_BITS_VALUE(key_bits) key_bits,
+static const int key_bits_variants[] = { KEY_BITS_VARIANTS(KEY_BITS_VALUE) };
+#define NUM_KEY_VARIANTS (int)(sizeof(key_bits_variants) / sizeof(key_bits_variants[0]))
+
+// Bins width thousandths wide up to the bin of dist_sq
+static int64_t bins_for_distance(int64_t dist_sq, int width) {
+    // dist_sq is in bin b when 4 dist_sq < (width (2b + 1))^2, which only
+    // depends on floor(sqrt(4 dist_sq))
+    int64_t root = (int64_t)sqrt(4.0 * (double)dist_sq);
+    while (root * root > 4 * dist_sq) --root;
+    while ((root + 1) * (root + 1) <= 4 * dist_sq) ++root;
+    return (root + width) / (2 * width) + 1;
+}
+
+static int init_wide_bins(pair_counter_t *pc) {
+    pc->wide_upper = (int64_t *)malloc((pc->num_bins + 2) * sizeof(int64_t));
+    if (!pc->wide_upper) {
+        return 0;
+    }
+    pc->wide_upper += 1;
+    pc->wide_upper[-1] = -1;
+    for (int b = 0; b < pc->num_bins; ++b) {
+        uint64_t twice = (uint64_t)pc->width * (2 * (uint64_t)b + 1);
+        pc->wide_upper[b] = (int64_t)((twice * twice + 3) / 4 - 1);
+    }
+    pc->wide_upper[pc->num_bins] = INT64_MAX;
+    pc->inverse_width = 1.0 / pc->width;
+    return 1;
+}
+
+static int init_compact_bins(pair_counter_t *pc) {
+    pc->upper = (int32_t *)malloc((MAX_COMPACT_BINS + 1) * sizeof(int32_t));
+    pc->key_table = (uint16_t *)malloc((KEY_TABLE_SIZE(MAX_KEY_BITS) + 2) * sizeof(uint16_t));
+    if (!pc->upper || !pc->key_table) {
+        return 0;
+    }
+    for (int b = 0; b < pc->num_bins; ++b) {
+        // dist_sq < (width * (2b + 1) / 2)^2
+        uint64_t twice = (uint64_t)pc->width * (2 * b + 1);
+        uint64_t upper = (twice * twice + 3) / 4 - 1;
+        pc->upper[b] = (int32_t)(upper < INT32_MAX ? upper : INT32_MAX);
+    }
+    pc->upper[pc->num_bins] = INT32_MAX;
+    pc->clamp = (uint32_t)pc->upper[pc->num_bins - 1] + 1;
+
+    // Fewest key bits first
+    for (pc->key_variant = NUM_KEY_VARIANTS - 1; pc->key_variant > 0; --pc->key_variant) {
+        if (build_bin_key_table(pc, key_bits_variants[pc->key_variant])) {
+            break;
+        }
+    }
+    pc->key_bits = key_bits_variants[pc->key_variant];
+    return pc->key_variant > 0 || build_bin_key_table(pc, pc->key_bits);
+}
+
+int pair_counter_init(pair_counter_t *pc, int width, int64_t max_dist_sq, int wide) {
+    memset(pc, 0, sizeof(*pc));
+    int64_t num_bins = bins_for_distance(max_dist_sq, width);
+    if (num_bins > INT_MAX - 2) {
+        return 0;
+    }
+    pc->width = width;
+    pc->num_bins = (int)num_bins;
+    pc->wide = wide;
+    pc->tile_cells = TILE_CELLS;
+    pc->task_grain = 1;
+    int ok = wide ? init_wide_bins(pc) : init_compact_bins(pc);
+    if (!ok || !pair_counter_select(pc, NULL, 0)) {
+        pair_counter_free(pc);
+        return 0;
+    }
+    return 1;
+}
+
+void pair_counter_free(pair_counter_t *pc) {
+    free(pc->key_table);
+    free(pc->upper);
+    free(pc->wide_upper ? pc->wide_upper - 1 : NULL);
+    pc->key_table = NULL;
+    pc->upper = NULL;
+    pc->wide_upper = NULL;
+}
+
+void pair_counter_tune(pair_counter_t *pc, int tile_cells, int task_grain) {
+    if (tile_cells > 0) {
+        pc->tile_cells = tile_cells < MAX_TILE_CELLS ? tile_cells : MAX_TILE_CELLS;
+    }
+    if (task_grain > 0) {
+        pc->task_grain = task_grain;
+    }
+}
+
+int pair_bin_width(double width) {
+    double size = width * 1000.0;
+    if (!(size >= 10.0 && size <= 1e8)) {
+        return -1;
+    }
+    int thousandths = (int)lround(size);
+    if (!(fabs(size - thousandths) < 1e-6) || thousandths % 10 != 0) {
+        return -1;
+    }
+    return thousandths;
+}
+
+// The kernels below take key_bits as a constant: they are always inlined
+// into one instance per key width, see PAIR_ROW_INSTANCES
+#define PAIR_ROW_PARAMS const pair_counter_t *pc, int16_t xi, int16_t yi, int16_t zi, \
+                        const int16_t *xs, const int16_t *ys, const int16_t *zs, int n, uint32_t *counts
+#define PAIR_ROW_ARGS pc, xi, yi, zi, xs, ys, zs, n, counts
+#define INLINE_KERNEL static inline __attribute__((always_inline))
+
+INLINE_KERNEL void pair_row_scalar_bits(PAIR_ROW_PARAMS, const int key_bits) {
+    for (int j = 0; j < n; ++j) {
+        int16_t dx = xi - xs[j];
+        int16_t dy = yi - ys[j];
+        int16_t dz = zi - zs[j];
+
+        int32_t dist_sq = (int32_t)dx * dx + (int32_t)dy * dy + (int32_t)dz * dz;
+        counts[dist_sq_to_bin_bits(pc, (uint32_t)dist_sq, key_bits)]++;
+    }
+}
+
+// The SIMD kernels subtract in int16 lanes, so they wrap exactly like the
+// scalar kernel. Interleaving dx with dy (and dz with zero) lets madd produce
+// the int32 squared distance of each cell directly. The unpacks permute the
+// cells within a vector, which does not matter for a histogram.
+//
+// With gathers available the table lookup is vectorized too. The leading
+// bit position comes from the exponent of dist_sq converted to float; when
+// the conversion rounds up to the next power of two the key is unchanged.
+
+__attribute__((target("sse4.1")))
+INLINE_KERNEL void pair_row_sse41_bits(PAIR_ROW_PARAMS, const int key_bits) {
+    const __m128i vx = _mm_set1_epi16(xi);
+    const __m128i vy = _mm_set1_epi16(yi);
+    const __m128i vz = _mm_set1_epi16(zi);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t dsq[8];
+
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m128i dx = _mm_sub_epi16(vx, _mm_loadu_si128((const __m128i *)(xs + j)));
+        __m128i dy = _mm_sub_epi16(vy, _mm_loadu_si128((const __m128i *)(ys + j)));
+        __m128i dz = _mm_sub_epi16(vz, _mm_loadu_si128((const __m128i *)(zs + j)));
+
+        __m128i dxy_lo = _mm_unpacklo_epi16(dx, dy);
+        __m128i dxy_hi = _mm_unpackhi_epi16(dx, dy);
+        __m128i dz_lo = _mm_unpacklo_epi16(dz, zero);
+        __m128i dz_hi = _mm_unpackhi_epi16(dz, zero);
+        _mm_storeu_si128((__m128i *)dsq,
+                         _mm_add_epi32(_mm_madd_epi16(dxy_lo, dxy_lo), _mm_madd_epi16(dz_lo, dz_lo)));
+        _mm_storeu_si128((__m128i *)(dsq + 4),
+                         _mm_add_epi32(_mm_madd_epi16(dxy_hi, dxy_hi), _mm_madd_epi16(dz_hi, dz_hi)));
+
+        for (int k = 0; k < 8; ++k) {
+            counts[dist_sq_to_bin_bits(pc, dsq[k], key_bits)]++;
+        }
+    }
+    pair_row_scalar_bits(pc, xi, yi, zi, xs + j, ys + j, zs + j, n - j, counts, key_bits);
+}
+
+__attribute__((target("avx2")))
+INLINE_KERNEL __m256i bin_avx2(const pair_counter_t *pc, __m256i dist_sq, __m256i clamp, const int key_bits) {
+    dist_sq = _mm256_min_epu32(dist_sq, clamp);
+    __m256i exponent = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(dist_sq)), 23);
+    __m256i shift = _mm256_max_epi32(_mm256_sub_epi32(exponent, _mm256_set1_epi32(127 + key_bits)),
+                                     _mm256_setzero_si256());
+    __m256i key = _mm256_add_epi32(_mm256_srlv_epi32(dist_sq, shift),
+                                   _mm256_slli_epi32(shift, key_bits));
+    __m256i bin = _mm256_and_si256(_mm256_i32gather_epi32((const int *)pc->key_table, key, 2),
+                                   _mm256_set1_epi32(0xffff));
+    __m256i upper = _mm256_i32gather_epi32(pc->upper, bin, 4);
+    return _mm256_sub_epi32(bin, _mm256_cmpgt_epi32(dist_sq, upper));
+}
+
+__attribute__((target("avx2")))
+INLINE_KERNEL void pair_row_avx2_bits(PAIR_ROW_PARAMS, const int key_bits) {
+    const __m256i vx = _mm256_set1_epi16(xi);
+    const __m256i vy = _mm256_set1_epi16(yi);
+    const __m256i vz = _mm256_set1_epi16(zi);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i clamp = _mm256_set1_epi32((int32_t)pc->clamp);
+    int32_t idx[16];
+
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m256i dx = _mm256_sub_epi16(vx, _mm256_loadu_si256((const __m256i *)(xs + j)));
+        __m256i dy = _mm256_sub_epi16(vy, _mm256_loadu_si256((const __m256i *)(ys + j)));
+        __m256i dz = _mm256_sub_epi16(vz, _mm256_loadu_si256((const __m256i *)(zs + j)));
+
+        __m256i dxy_lo = _mm256_unpacklo_epi16(dx, dy);
+        __m256i dxy_hi = _mm256_unpackhi_epi16(dx, dy);
+        __m256i dz_lo = _mm256_unpacklo_epi16(dz, zero);
+        __m256i dz_hi = _mm256_unpackhi_epi16(dz, zero);
+        __m256i dsq_lo = _mm256_add_epi32(_mm256_madd_epi16(dxy_lo, dxy_lo), _mm256_madd_epi16(dz_lo, dz_lo));
+        __m256i dsq_hi = _mm256_add_epi32(_mm256_madd_epi16(dxy_hi, dxy_hi), _mm256_madd_epi16(dz_hi, dz_hi));
+
+        _mm256_storeu_si256((__m256i *)idx, bin_avx2(pc, dsq_lo, clamp, key_bits));
+        _mm256_storeu_si256((__m256i *)(idx + 8), bin_avx2(pc, dsq_hi, clamp, key_bits));
+        for (int k = 0; k < 16; ++k) {
+            counts[idx[k]]++;
+        }
+    }
+    pair_row_scalar_bits(pc, xi, yi, zi, xs + j, ys + j, zs + j, n - j, counts, key_bits);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+INLINE_KERNEL __m512i bin_avx512(const pair_counter_t *pc, __m512i dist_sq, __m512i clamp, const int key_bits) {
+    dist_sq = _mm512_min_epu32(dist_sq, clamp);
+    __m512i exponent = _mm512_srli_epi32(_mm512_castps_si512(_mm512_cvtepi32_ps(dist_sq)), 23);
+    __m512i shift = _mm512_max_epi32(_mm512_sub_epi32(exponent, _mm512_set1_epi32(127 + key_bits)),
+                                     _mm512_setzero_si512());
+    __m512i key = _mm512_add_epi32(_mm512_srlv_epi32(dist_sq, shift),
+                                   _mm512_slli_epi32(shift, key_bits));
+    __m512i bin = _mm512_and_si512(_mm512_i32gather_epi32(key, (const void *)pc->key_table, 2),
+                                   _mm512_set1_epi32(0xffff));
+    __m512i upper = _mm512_i32gather_epi32(bin, (const void *)pc->upper, 4);
+    __mmask16 above = _mm512_cmpgt_epi32_mask(dist_sq, upper);
+    return _mm512_mask_add_epi32(bin, above, bin, _mm512_set1_epi32(1));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+INLINE_KERNEL void pair_row_avx512_bits(PAIR_ROW_PARAMS, const int key_bits) {
+    const __m512i vx = _mm512_set1_epi16(xi);
+    const __m512i vy = _mm512_set1_epi16(yi);
+    const __m512i vz = _mm512_set1_epi16(zi);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i clamp = _mm512_set1_epi32((int32_t)pc->clamp);
+    int32_t idx[32];
+
+    int j = 0;
+    for (; j + 32 <= n; j += 32) {
+        __m512i dx = _mm512_sub_epi16(vx, _mm512_loadu_si512((const void *)(xs + j)));
+        __m512i dy = _mm512_sub_epi16(vy, _mm512_loadu_si512((const void *)(ys + j)));
+        __m512i dz = _mm512_sub_epi16(vz, _mm512_loadu_si512((const void *)(zs + j)));
+
+        __m512i dxy_lo = _mm512_unpacklo_epi16(dx, dy);
+        __m512i dxy_hi = _mm512_unpackhi_epi16(dx, dy);
+        __m512i dz_lo = _mm512_unpacklo_epi16(dz, zero);
+        __m512i dz_hi = _mm512_unpackhi_epi16(dz, zero);
+        __m512i dsq_lo = _mm512_add_epi32(_mm512_madd_epi16(dxy_lo, dxy_lo), _mm512_madd_epi16(dz_lo, dz_lo));
+        __m512i dsq_hi = _mm512_add_epi32(_mm512_madd_epi16(dxy_hi, dxy_hi), _mm512_madd_epi16(dz_hi, dz_hi));
+
+        _mm512_storeu_si512((void *)idx, bin_avx512(pc, dsq_lo, clamp, key_bits));
+        _mm512_storeu_si512((void *)(idx + 16), bin_avx512(pc, dsq_hi, clamp, key_bits));
+        for (int k = 0; k < 32; ++k) {
+            counts[idx[k]]++;
+        }
+    }
+    pair_row_scalar_bits(pc, xi, yi, zi, xs + j, ys + j, zs + j, n - j, counts, key_bits);
+}
+
+// One instance of every kernel per key width, e.g. pair_row_avx2_9
+#define PAIR_ROW_INSTANCES(key_bits) \
+    static void pair_row_scalar_##key_bits(PAIR_ROW_PARAMS) { \
+        pair_row_scalar_bits(PAIR_ROW_ARGS, key_bits); \
+    } \
+    __attribute__((target("sse4.1"))) static void pair_row_sse41_##key_bits(PAIR_ROW_PARAMS) { \
+        pair_row_sse41_bits(PAIR_ROW_ARGS, key_bits); \
+    } \
+    __attribute__((target("avx2"))) static void pair_row_avx2_##key_bits(PAIR_ROW_PARAMS) { \
+        pair_row_avx2_bits(PAIR_ROW_ARGS, key_bits); \
+    } \
+    __attribute__((target("avx512f,avx512bw"))) static void pair_row_avx512_##key_bits(PAIR_ROW_PARAMS) { \
+        pair_row_avx512_bits(PAIR_ROW_ARGS, key_bits); \
+    }
+KEY_BITS_VARIANTS(PAIR_ROW_INSTANCES)
+
+// The GEMM engine, --gemm, counts the pairs of two different tiles the way
+// BLAS multiplies matrices. With the squared norms of the cells,
+// |a - b|^2 = |a|^2 + |b|^2 - 2 a.b, so only the rank 3 product a.b is
+// left per pair. Each panel of GEMM_PANEL_CELLS cells of the second tile is
+// packed once, (x, y) as the int16 halves of one int32 lane, (z, 0) in a
+// second and the norm in a third, so one madd per lane pair gives x and y.
+// GEMM_ROWS rows of the first tile are held in registers against each
+// vector of the panel, and the binning is fused in.
+//
+// Everything wraps in uint32, which is exact: the true squared distance of
+// compact coordinates is below 2^31, whatever the intermediate sums are.
+#define GEMM_PANEL_CELLS 256
+#define GEMM_ROWS 4
+
+typedef struct {
+    int32_t xy[GEMM_PANEL_CELLS];
+    int32_t z[GEMM_PANEL_CELLS];
+    uint32_t norm[GEMM_PANEL_CELLS];
+} gemm_panel_t;
+
+static inline int32_t pack_pair(int16_t low, int16_t high) {
+    return (int32_t)((uint32_t)(uint16_t)low | (uint32_t)(uint16_t)high << 16);
+}
+
+static inline uint32_t squared_norm(int16_t x, int16_t y, int16_t z) {
+    return (uint32_t)(x * x) + (uint32_t)(y * y) + (uint32_t)(z * z);
+}
+
+static void pack_gemm_panel(gemm_panel_t *panel, const int16_t *xs, const int16_t *ys, const int16_t *zs, int n) {
+    for (int j = 0; j < n; ++j) {
+        panel->xy[j] = pack_pair(xs[j], ys[j]);
+        panel->z[j] = pack_pair(zs[j], 0);
+        panel->norm[j] = squared_norm(xs[j], ys[j], zs[j]);
+    }
+}
+
+// The blocks count rows cells (xs, ys, zs) against panel cells begin .. n - 1.
+// rows is a constant, GEMM_ROWS or 1, so the row loops unroll.
+#define GEMM_BLOCK_PARAMS const pair_counter_t *pc, const int16_t *xs, const int16_t *ys, const int16_t *zs, const int rows, \
+                          const gemm_panel_t *panel, int begin, int n, uint32_t *counts
+
+INLINE_KERNEL void gemm_block_scalar_bits(GEMM_BLOCK_PARAMS, const int key_bits) {
+    for (int r = 0; r < rows; ++r) {
+        const uint32_t norm = squared_norm(xs[r], ys[r], zs[r]);
+        for (int j = begin; j < n; ++j) {
+            uint32_t dot = (uint32_t)(xs[r] * (int16_t)panel->xy[j]) + (uint32_t)(ys[r] * (int16_t)(panel->xy[j] >> 16)) +
+                           (uint32_t)(zs[r] * (int16_t)panel->z[j]);
+            counts[dist_sq_to_bin_bits(pc, norm + panel->norm[j] - 2 * dot, key_bits)]++;
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+INLINE_KERNEL void gemm_block_sse41_bits(GEMM_BLOCK_PARAMS, const int key_bits) {
+    __m128i axy[GEMM_ROWS], az[GEMM_ROWS], anorm[GEMM_ROWS];
+    for (int r = 0; r < rows; ++r) {
+        axy[r] = _mm_set1_epi32(pack_pair(xs[r], ys[r]));
+        az[r] = _mm_set1_epi32(pack_pair(zs[r], 0));
+        anorm[r] = _mm_set1_epi32((int32_t)squared_norm(xs[r], ys[r], zs[r]));
+    }
+    uint32_t dsq[GEMM_ROWS * 4];
+
+    int j = begin;
+    for (; j + 4 <= n; j += 4) {
+        __m128i bxy = _mm_loadu_si128((const __m128i *)(panel->xy + j));
+        __m128i bz = _mm_loadu_si128((const __m128i *)(panel->z + j));
+        __m128i bnorm = _mm_loadu_si128((const __m128i *)(panel->norm + j));
+        for (int r = 0; r < rows; ++r) {
+            __m128i dot = _mm_add_epi32(_mm_madd_epi16(bxy, axy[r]), _mm_madd_epi16(bz, az[r]));
+            _mm_storeu_si128((__m128i *)(dsq + 4 * r),
+                             _mm_sub_epi32(_mm_add_epi32(bnorm, anorm[r]), _mm_slli_epi32(dot, 1)));
+        }
+        for (int k = 0; k < 4 * rows; ++k) {
+            counts[dist_sq_to_bin_bits(pc, dsq[k], key_bits)]++;
+        }
+    }
+    gemm_block_scalar_bits(pc, xs, ys, zs, rows, panel, j, n, counts, key_bits);
+}
+
+__attribute__((target("avx2")))
+INLINE_KERNEL void gemm_block_avx2_bits(GEMM_BLOCK_PARAMS, const int key_bits) {
+    const __m256i clamp = _mm256_set1_epi32((int32_t)pc->clamp);
+    __m256i axy[GEMM_ROWS], az[GEMM_ROWS], anorm[GEMM_ROWS];
+    for (int r = 0; r < rows; ++r) {
+        axy[r] = _mm256_set1_epi32(pack_pair(xs[r], ys[r]));
+        az[r] = _mm256_set1_epi32(pack_pair(zs[r], 0));
+        anorm[r] = _mm256_set1_epi32((int32_t)squared_norm(xs[r], ys[r], zs[r]));
+    }
+    int32_t idx[GEMM_ROWS * 8];
+
+    int j = begin;
+    for (; j + 8 <= n; j += 8) {
+        __m256i bxy = _mm256_loadu_si256((const __m256i *)(panel->xy + j));
+        __m256i bz = _mm256_loadu_si256((const __m256i *)(panel->z + j));
+        __m256i bnorm = _mm256_loadu_si256((const __m256i *)(panel->norm + j));
+        for (int r = 0; r < rows; ++r) {
+            __m256i dot = _mm256_add_epi32(_mm256_madd_epi16(bxy, axy[r]), _mm256_madd_epi16(bz, az[r]));
+            __m256i dist_sq = _mm256_sub_epi32(_mm256_add_epi32(bnorm, anorm[r]), _mm256_slli_epi32(dot, 1));
+            _mm256_storeu_si256((__m256i *)(idx + 8 * r), bin_avx2(pc, dist_sq, clamp, key_bits));
+        }
+        for (int k = 0; k < 8 * rows; ++k) {
+            counts[idx[k]]++;
+        }
+    }
+    gemm_block_scalar_bits(pc, xs, ys, zs, rows, panel, j, n, counts, key_bits);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+INLINE_KERNEL void gemm_block_avx512_bits(GEMM_BLOCK_PARAMS, const int key_bits) {
+    const __m512i clamp = _mm512_set1_epi32((int32_t)pc->clamp);
+    __m512i axy[GEMM_ROWS], az[GEMM_ROWS], anorm[GEMM_ROWS];
+    for (int r = 0; r < rows; ++r) {
+        axy[r] = _mm512_set1_epi32(pack_pair(xs[r], ys[r]));
+        az[r] = _mm512_set1_epi32(pack_pair(zs[r], 0));
+        anorm[r] = _mm512_set1_epi32((int32_t)squared_norm(xs[r], ys[r], zs[r]));
+    }
+    int32_t idx[GEMM_ROWS * 16];
+
+    int j = begin;
+    for (; j + 16 <= n; j += 16) {
+        __m512i bxy = _mm512_loadu_si512((const void *)(panel->xy + j));
+        __m512i bz = _mm512_loadu_si512((const void *)(panel->z + j));
+        __m512i bnorm = _mm512_loadu_si512((const void *)(panel->norm + j));
+        for (int r = 0; r < rows; ++r) {
+            __m512i dot = _mm512_add_epi32(_mm512_madd_epi16(bxy, axy[r]), _mm512_madd_epi16(bz, az[r]));
+            __m512i dist_sq = _mm512_sub_epi32(_mm512_add_epi32(bnorm, anorm[r]), _mm512_slli_epi32(dot, 1));
+            _mm512_storeu_si512((void *)(idx + 16 * r), bin_avx512(pc, dist_sq, clamp, key_bits));
+        }
+        for (int k = 0; k < 16 * rows; ++k) {
+            counts[idx[k]]++;
+        }
+    }
+    gemm_block_scalar_bits(pc, xs, ys, zs, rows, panel, j, n, counts, key_bits);
+}
+
+// Packs each panel of the second tile and runs the row blocks of the first
+// one over it
+#define PAIR_TILE_PARAMS const pair_counter_t *pc, const int16_t *xs1, const int16_t *ys1, const int16_t *zs1, int n1, \
+                         const int16_t *xs2, const int16_t *ys2, const int16_t *zs2, int n2, uint32_t *counts
+#define GEMM_TILE(block, key_bits) \
+    gemm_panel_t panel; \
+    for (int p = 0; p < n2; p += GEMM_PANEL_CELLS) { \
+        int n = n2 - p < GEMM_PANEL_CELLS ? n2 - p : GEMM_PANEL_CELLS; \
+        pack_gemm_panel(&panel, xs2 + p, ys2 + p, zs2 + p, n); \
+        int i = 0; \
+        for (; i + GEMM_ROWS <= n1; i += GEMM_ROWS) { \
+            block(pc, xs1 + i, ys1 + i, zs1 + i, GEMM_ROWS, &panel, 0, n, counts, key_bits); \
+        } \
+        for (; i < n1; ++i) { \
+            block(pc, xs1 + i, ys1 + i, zs1 + i, 1, &panel, 0, n, counts, key_bits); \
+        } \
+    }
+
+#define GEMM_TILE_INSTANCES(key_bits) \
+    static void gemm_tile_scalar_##key_bits(PAIR_TILE_PARAMS) { \
+        GEMM_TILE(gemm_block_scalar_bits, key_bits) \
+    } \
+    __attribute__((target("sse4.1"))) static void gemm_tile_sse41_##key_bits(PAIR_TILE_PARAMS) { \
+        GEMM_TILE(gemm_block_sse41_bits, key_bits) \
+    } \
+    __attribute__((target("avx2"))) static void gemm_tile_avx2_##key_bits(PAIR_TILE_PARAMS) { \
+        GEMM_TILE(gemm_block_avx2_bits, key_bits) \
+    } \
+    __attribute__((target("avx512f,avx512bw"))) static void gemm_tile_avx512_##key_bits(PAIR_TILE_PARAMS) { \
+        GEMM_TILE(gemm_block_avx512_bits, key_bits) \
+    }
+KEY_BITS_VARIANTS(GEMM_TILE_INSTANCES)
+
+#define SCALAR_ROW(key_bits) pair_row_scalar_##key_bits,
+#define SSE41_ROW(key_bits) pair_row_sse41_##key_bits,
+#define AVX2_ROW(key_bits) pair_row_avx2_##key_bits,
+#define AVX512_ROW(key_bits) pair_row_avx512_##key_bits,
+#define SCALAR_TILE(key_bits) gemm_tile_scalar_##key_bits,
+#define SSE41_TILE(key_bits) gemm_tile_sse41_##key_bits,
+#define AVX2_TILE(key_bits) gemm_tile_avx2_##key_bits,
+#define AVX512_TILE(key_bits) gemm_tile_avx512_##key_bits,
+
+typedef struct {
+    const char *name;
+    const char *cpu_feature; // NULL if the kernel runs on any x86-64
+    pair_row_fn rows[NUM_KEY_VARIANTS]; // By key_variant
+    pair_tile_fn tiles[NUM_KEY_VARIANTS]; // The GEMM engine's, by key_variant
+} pair_kernel_t;
+
+// Ordered from fastest to slowest, the first supported one is the default
+static const pair_kernel_t pair_kernels[] = {
+    { "avx512", "avx512bw", { KEY_BITS_VARIANTS(AVX512_ROW) }, { KEY_BITS_VARIANTS(AVX512_TILE) } },
+    { "avx2",   "avx2",     { KEY_BITS_VARIANTS(AVX2_ROW)   }, { KEY_BITS_VARIANTS(AVX2_TILE)   } },
+    { "sse4.1", "sse4.1",   { KEY_BITS_VARIANTS(SSE41_ROW)  }, { KEY_BITS_VARIANTS(SSE41_TILE)  } },
+    { "scalar", NULL,       { KEY_BITS_VARIANTS(SCALAR_ROW) }, { KEY_BITS_VARIANTS(SCALAR_TILE) } },
+};
+#define NUM_PAIR_KERNELS (int)(sizeof(pair_kernels) / sizeof(pair_kernels[0]))
+
+// Kernel for wide coordinates, like pair_row_fn with int32 coordinates.
+// The estimate is off by at most one bin: the double sqrt is accurate to
+// far less than the narrowest bin.
+static void pair_row_wide(const pair_counter_t *pc, int32_t xi, int32_t yi, int32_t zi,
+                          const int32_t *xs, const int32_t *ys, const int32_t *zs,
+                          int n, uint32_t *counts) {
+    const int last_bin = pc->num_bins - 1;
+    const int64_t *wide_upper = pc->wide_upper;
+    for (int j = 0; j < n; ++j) {
+        int64_t dx = (int64_t)xi - xs[j];
+        int64_t dy = (int64_t)yi - ys[j];
+        int64_t dz = (int64_t)zi - zs[j];
+        int64_t dist_sq = dx * dx + dy * dy + dz * dz;
+
+        int bin = (int)(sqrt((double)dist_sq) * pc->inverse_width + 0.5);
+        bin = bin < last_bin ? bin : last_bin;
+        bin -= dist_sq <= wide_upper[bin - 1];
+        bin += dist_sq > wide_upper[bin];
+        counts[bin]++;
+    }
+}
+
+static int cpu_supports(const char *feature) {
+    if (feature == NULL) {
+        return 1;
+    }
+    __builtin_cpu_init();
+    // __builtin_cpu_supports needs a string literal
+    if (strcmp(feature, "avx512bw") == 0) return __builtin_cpu_supports("avx512bw");
+    if (strcmp(feature, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(feature, "sse4.1") == 0) return __builtin_cpu_supports("sse4.1");
+    return 0;
+}
+
+// Takes the kernel's instance for the key width of the bins
+int pair_counter_select(pair_counter_t *pc, const char *name, int gemm) {
+    for (int k = 0; k < NUM_PAIR_KERNELS; ++k) {
+        if (name != NULL && strcmp(name, pair_kernels[k].name) != 0) {
+            continue;
+        }
+        if (cpu_supports(pair_kernels[k].cpu_feature)) {
+            pc->kernel_name = pair_kernels[k].name;
+            pc->row = pair_kernels[k].rows[pc->key_variant];
+            pc->tile = gemm ? pair_kernels[k].tiles[pc->key_variant] : NULL;
+            return 1;
+        }
+        if (name != NULL) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int pair_hists_init(thread_hists_t *hists, int num_threads, int num_bins) {
+    hists->num_threads = num_threads;
+    hists->num_bins = num_bins;
+    hists->threads = (thread_hist_t **)calloc(num_threads, sizeof(thread_hist_t *));
+    if (!hists->threads) {
+        return 0;
+    }
+
+    // Each thread allocates and first touches its own histogram
+    int failed = 0;
+    #pragma omp parallel num_threads(num_threads) reduction(|:failed)
+    {
+        size_t header = (sizeof(thread_hist_t) + 63) / 64 * 64;
+        size_t counts = ((num_bins + 1) * sizeof(uint32_t) + 63) / 64 * 64;
+        size_t totals = (num_bins + 1) * sizeof(uint64_t);
+        thread_hist_t *hist = (thread_hist_t *)aligned_alloc(64, (header + counts + totals + 63) / 64 * 64);
+        if (hist) {
+            memset(hist, 0, header + counts + totals);
+            hist->counts = (uint32_t *)((char *)hist + header);
+            hist->totals = (uint64_t *)((char *)hist + header + counts);
+        }
+        hists->threads[omp_get_thread_num()] = hist;
+        failed |= !hist;
+    }
+    if (failed) {
+        for (int t = 0; t < num_threads; ++t) {
+            free(hists->threads[t]);
+        }
+        free(hists->threads);
+        return 0;
+    }
+    return 1;
+}
+
+thread_hist_t *pair_hists_reserve(thread_hists_t *hists, long int num_pairs) {
+    thread_hist_t *hist = hists->threads[omp_get_thread_num()];
+    if (hist->pending + (uint64_t)num_pairs > UINT32_MAX) {
+        for (int k = 0; k <= hists->num_bins; ++k) {
+            hist->totals[k] += hist->counts[k];
+            hist->counts[k] = 0;
+        }
+        hist->pending = 0;
+    }
+    hist->pending += (uint64_t)num_pairs;
+    return hist;
+}
+
+void pair_hists_merge(const thread_hists_t *hists, long int *counts) {
+    #pragma omp parallel for schedule(static)
+    for (int k = 0; k < hists->num_bins; ++k) {
+        uint64_t sum = 0;
+        for (int t = 0; t < hists->num_threads; ++t) {
+            sum += hists->threads[t]->totals[k] + hists->threads[t]->counts[k];
+        }
+        counts[k] += (long int)sum;
+    }
+}
+
+void pair_hists_clear(thread_hists_t *hists) {
+    for (int t = 0; t < hists->num_threads; ++t) {
+        thread_hist_t *hist = hists->threads[t];
+        memset(hist->counts, 0, (hists->num_bins + 1) * sizeof(uint32_t));
+        memset(hist->totals, 0, (hists->num_bins + 1) * sizeof(uint64_t));
+        hist->pending = 0;
+    }
+}
+
+void pair_hists_free(thread_hists_t *hists) {
+    for (int t = 0; t < hists->num_threads; ++t) {
+        free(hists->threads[t]);
+    }
+    free(hists->threads);
+}
+
+// Distances from the cells in tile1 to those in tile2 (starting at cell
+// index begin2), or between the cells of tile1 if it is the same tile
+static inline void tile_pair(const pair_counter_t *pc, const chunk_coords_t *chunk1, int begin1, int end1,
+                             const chunk_coords_t *chunk2, int begin2, int end2,
+                             int same_tile, uint32_t *counts) {
+    if (chunk1->x32) {
+        for (int i = begin1; i < end1; ++i) {
+            int j = same_tile ? i + 1 : begin2;
+            pair_row_wide(pc, chunk1->x32[i], chunk1->y32[i], chunk1->z32[i],
+                          chunk2->x32 + j, chunk2->y32 + j, chunk2->z32 + j, end2 - j, counts);
+        }
+        return;
+    }
+    if (pc->tile && !same_tile) {
+        pc->tile(pc, chunk1->x + begin1, chunk1->y + begin1, chunk1->z + begin1, end1 - begin1,
+                 chunk2->x + begin2, chunk2->y + begin2, chunk2->z + begin2, end2 - begin2, counts);
+        return;
+    }
+    for (int i = begin1; i < end1; ++i) {
+        int j = same_tile ? i + 1 : begin2;
+        pc->row(pc, chunk1->x[i], chunk1->y[i], chunk1->z[i],
+                chunk2->x + j, chunk2->y + j, chunk2->z + j, end2 - j, counts);
+    }
+}
+
+void pair_count_in_chunk(const pair_counter_t *pc, const chunk_coords_t *chunk, thread_hists_t *hists) {
+    // Tile pairs (a, b) with a <= b. The full off-diagonal pairs come first,
+    // ordered so the ones involving the short last tile are at the end, and
+    // the half-size diagonal pairs close the schedule.
+    const int tile_cells = pc->tile_cells;
+    const int num_tiles = (chunk->num_cells + tile_cells - 1) / tile_cells;
+    const long int off_diagonal = (long int)num_tiles * (num_tiles - 1) / 2;
+    const long int num_tasks = off_diagonal + num_tiles;
+
+    #pragma omp parallel for schedule(dynamic, pc->task_grain)
+    for (long int task = 0; task < num_tasks; ++task) {
+        int a, b;
+        if (task < off_diagonal) {
+            // task = b (b - 1) / 2 + a with a < b
+            b = (int)((1.0 + sqrt(1.0 + 8.0 * (double)task)) / 2.0);
+            while ((long int)b * (b - 1) / 2 > task) --b;
+            while ((long int)(b + 1) * b / 2 <= task) ++b;
+            a = (int)(task - (long int)b * (b - 1) / 2);
+        } else {
+            a = b = (int)(task - off_diagonal);
+        }
+        int end_a = (a + 1) * tile_cells < chunk->num_cells ? (a + 1) * tile_cells : chunk->num_cells;
+        int end_b = (b + 1) * tile_cells < chunk->num_cells ? (b + 1) * tile_cells : chunk->num_cells;
+        long int pairs = a == b ? (long int)(end_a - a * tile_cells) * (end_a - a * tile_cells - 1) / 2
+                                : (long int)(end_a - a * tile_cells) * (end_b - b * tile_cells);
+        thread_hist_t *hist = pair_hists_reserve(hists, pairs);
+        tile_pair(pc, chunk, a * tile_cells, end_a, chunk, b * tile_cells, end_b, a == b, hist->counts);
+    }
+}
+
+void pair_count_between_chunks(const pair_counter_t *pc, const chunk_coords_t *chunk1, const chunk_coords_t *chunk2,
+                               const int *thread_node, thread_hists_t *hists) {
+    const int tile_cells = pc->tile_cells;
+    const int num_tiles1 = (chunk1->num_cells + tile_cells - 1) / tile_cells;
+    const int num_tiles2 = (chunk2->num_cells + tile_cells - 1) / tile_cells;
+    const long int num_tasks = (long int)num_tiles1 * num_tiles2;
+
+    #pragma omp parallel for schedule(dynamic, pc->task_grain)
+    for (long int task = 0; task < num_tasks; ++task) {
+        int a = (int)(task / num_tiles2);
+        int b = (int)(task % num_tiles2);
+        int end_a = (a + 1) * tile_cells < chunk1->num_cells ? (a + 1) * tile_cells : chunk1->num_cells;
+        int end_b = (b + 1) * tile_cells < chunk2->num_cells ? (b + 1) * tile_cells : chunk2->num_cells;
+        thread_hist_t *hist = pair_hists_reserve(hists, (long int)(end_a - a * tile_cells) * (end_b - b * tile_cells));
+        const chunk_coords_t *local2 = thread_node ? &chunk2[thread_node[omp_get_thread_num()]] : chunk2;
+        tile_pair(pc, chunk1, a * tile_cells, end_a, local2, b * tile_cells, end_b, 0, hist->counts);
+    }
+}
+
+// The library API of pair_hist.h. Each context has its own bins, kernel and
+// histograms, and a call restores the thread count when it returns.
+struct pair_hist_context {
+    int num_threads;
+    pair_counter_t counter;
+    thread_hists_t hists;
+};
+
+pair_hist_context_t *pair_hist_create(const pair_hist_options_t *options) {
+    pair_hist_options_t defaults = { 0, 0.0, NULL, 0, 0 };
+    if (!options) {
+        options = &defaults;
+    }
+    int width = options->bin_width > 0.0 ? pair_bin_width(options->bin_width) : 10;
+    if (width < 0 || options->num_threads < 0 || options->num_threads > MAX_THREADS ||
+        options->tile_cells < 0 || options->task_grain < 0) {
+        return NULL;
+    }
+    pair_hist_context_t *ctx = (pair_hist_context_t *)calloc(1, sizeof(pair_hist_context_t));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->num_threads = options->num_threads > 0 ? options->num_threads : omp_get_max_threads();
+    if (!pair_counter_init(&ctx->counter, width, MAX_DISTANCE_SQ, 0)) {
+        free(ctx);
+        return NULL;
+    }
+    pair_counter_tune(&ctx->counter, options->tile_cells, options->task_grain);
+    if (!pair_counter_select(&ctx->counter, options->kernel, 0) ||
+        !pair_hists_init(&ctx->hists, ctx->num_threads, ctx->counter.num_bins)) {
+        pair_counter_free(&ctx->counter);
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void pair_hist_destroy(pair_hist_context_t *ctx) {
+    if (ctx) {
+        pair_hists_free(&ctx->hists);
+        pair_counter_free(&ctx->counter);
+        free(ctx);
+    }
+}
+
+int pair_hist_num_bins(const pair_hist_context_t *ctx) {
+    return ctx->counter.num_bins;
+}
+
+// Checks a caller's set and wraps it as a chunk
+static int library_chunk(const pair_hist_cells_t *cells, chunk_coords_t *chunk) {
+    if (!cells || cells->num_cells < 0 || cells->num_cells > INT_MAX ||
+        (cells->num_cells > 0 && (!cells->x || !cells->y || !cells->z))) {
+        return PAIR_HIST_INVALID;
+    }
+    int in_range = 1;
+    const long int n = cells->num_cells;
+    #pragma omp parallel for reduction(&&:in_range) schedule(static)
+    for (long int i = 0; i < n; ++i) {
+        in_range = in_range && cells->x[i] >= -10000 && cells->x[i] <= 10000 &&
+                   cells->y[i] >= -10000 && cells->y[i] <= 10000 &&
+                   cells->z[i] >= -10000 && cells->z[i] <= 10000;
+    }
+    if (!in_range) {
+        return PAIR_HIST_OUT_OF_RANGE;
+    }
+    *chunk = (chunk_coords_t){ .x = cells->x, .y = cells->y, .z = cells->z, .num_cells = (int)n };
+    return PAIR_HIST_OK;
+}
+
+static int library_count(pair_hist_context_t *ctx, const pair_hist_cells_t *cells1,
+                         const pair_hist_cells_t *cells2, long int *counts) {
+    if (!ctx || !counts) {
+        return PAIR_HIST_INVALID;
+    }
+    int saved_threads = omp_get_max_threads();
+    omp_set_num_threads(ctx->num_threads);
+
+    chunk_coords_t chunk1, chunk2;
+    int status = library_chunk(cells1, &chunk1);
+    if (status == PAIR_HIST_OK && cells2) {
+        status = library_chunk(cells2, &chunk2);
+    }
+    if (status == PAIR_HIST_OK) {
+        if (cells2) {
+            pair_count_between_chunks(&ctx->counter, &chunk1, &chunk2, NULL, &ctx->hists);
+        } else {
+            pair_count_in_chunk(&ctx->counter, &chunk1, &ctx->hists);
+        }
+        pair_hists_merge(&ctx->hists, counts);
+        pair_hists_clear(&ctx->hists);
+    }
+    omp_set_num_threads(saved_threads);
+    return status;
+}
+
+int pair_hist_count_within(pair_hist_context_t *ctx, const pair_hist_cells_t *cells, long int *counts) {
+    return library_count(ctx, cells, NULL, counts);
+}
+
+int pair_hist_count_between(pair_hist_context_t *ctx, const pair_hist_cells_t *cells1,
+                            const pair_hist_cells_t *cells2, long int *counts) {
+    if (!cells2) {
+        return PAIR_HIST_INVALID;
+    }
+    return library_count(ctx, cells1, cells2, counts);
+}
+
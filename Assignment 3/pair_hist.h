@@ -0,0 +1,58 @@
+#ifndef PAIR_HIST_H
+#define PAIR_HIST_H
+
+#include <stdint.h>
+
+// The pair-distance histogram kernels of distances as a library, for
+// coordinates that are already in memory. Link with libpairhist.a and
+// -fopenmp -lpthread -lm.
+//
+// Coordinates are in thousandths, as int16 arrays per axis in
+// [-10000, 10000], the range of the cell file. Bin b counts the distances
+// in [(b - 1/2) * width, (b + 1/2) * width), like the output of distances.
+//
+// A context holds the settings, the per-thread histograms and the thread
+// count of its calls, and is reused across calls. Each context has its own
+// bin tables, so different contexts may count at the same time, but one
+// context must not be used by two threads at once.
+
+#define PAIR_HIST_OK 0
+#define PAIR_HIST_INVALID -1        // Bad options or set sizes
+#define PAIR_HIST_OUT_OF_RANGE -2   // A coordinate outside [-10000, 10000]
+
+typedef struct {
+    int num_threads;          // Threads per call, 0 for omp_get_max_threads()
+    double bin_width;         // A multiple of 0.01, 0 for 0.01
+    const char *kernel;       // "scalar", "sse4.1", "avx2" or "avx512", NULL for the fastest supported
+    int tile_cells;           // Cells per kernel tile, at most 65535, 0 for 1024
+    int task_grain;           // Tiles handed to a thread at a time, 0 for 1
+} pair_hist_options_t;
+
+// Cells of one set, num_cells of them in x, y and z
+typedef struct {
+    const int16_t *x;
+    const int16_t *y;
+    const int16_t *z;
+    long int num_cells;
+} pair_hist_cells_t;
+
+typedef struct pair_hist_context pair_hist_context_t;
+
+// NULL if the options are invalid, the kernel is not supported by the CPU
+// or memory runs out. options may be NULL for the defaults.
+pair_hist_context_t *pair_hist_create(const pair_hist_options_t *options);
+void pair_hist_destroy(pair_hist_context_t *ctx);
+
+// Bins that the counts buffers must hold
+int pair_hist_num_bins(const pair_hist_context_t *ctx);
+
+// Add the histogram of the distances between the cells of one set, each
+// pair once, to counts
+int pair_hist_count_within(pair_hist_context_t *ctx, const pair_hist_cells_t *cells, long int *counts);
+
+// Add the histogram of the distances from every cell of cells1 to every
+// cell of cells2 to counts
+int pair_hist_count_between(pair_hist_context_t *ctx, const pair_hist_cells_t *cells1,
+                            const pair_hist_cells_t *cells2, long int *counts);
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef PAIR_KERNELS_H
+#define PAIR_KERNELS_H
+
+#include <stdint.h>
+
+// The bins, pair kernels, per-thread histograms and tile loops of
+// pair_hist.c that distances uses besides the API of pair_hist.h. They are
+// not part of that API: a pair_counter_t holds everything a count needs,
+// so each library context and each run of distances has its own.
+
+#define MAX_THREADS 256
+// Squared diagonal of the usual cell file's box, +-10 on every axis
+#define MAX_DISTANCE_SQ (3LL * 20000 * 20000)
+
+// The kernels work on tiles of tile_cells cells, by default 6 KiB of
+// coordinates, so the tile a row is compared against stays in L1 across the
+// rows of the other tile. The parallel loops hand out task_grain tasks at a
+// time. Both can be set by a tuning profile, see --tune. A pair of tiles
+// is counted without flushing the 32-bit counts in between, so tiles hold at
+// most MAX_TILE_CELLS cells, whose square stays below UINT32_MAX.
+#define TILE_CELLS 1024
+#define MAX_TILE_CELLS 65535
+
+// Coordinates of the cells of a chunk, one array per axis: x, y and z for
+// compact coordinates, x32, y32 and z32 for wide ones, the others NULL
+typedef struct {
+    const int16_t *x;
+    const int16_t *y;
+    const int16_t *z;
+    int num_cells;
+    const int32_t *x32;
+    const int32_t *y32;
+    const int32_t *z32;
+} chunk_coords_t;
+
+typedef struct pair_counter pair_counter_t;
+
+// Kernel that accumulates the distances from one cell (xi, yi, zi) to the
+// n cells stored as separate x, y and z arrays into counts[num_bins + 1]
+typedef void (*pair_row_fn)(const pair_counter_t *pc, int16_t xi, int16_t yi, int16_t zi,
+                            const int16_t *xs, const int16_t *ys, const int16_t *zs,
+                            int n, uint32_t *counts);
+
+// Kernel that accumulates the distances between the n1 cells of one tile
+// and the n2 cells of another into counts[num_bins + 1]
+typedef void (*pair_tile_fn)(const pair_counter_t *pc,
+                             const int16_t *xs1, const int16_t *ys1, const int16_t *zs1, int n1,
+                             const int16_t *xs2, const int16_t *ys2, const int16_t *zs2, int n2,
+                             uint32_t *counts);
+
+// Bins width thousandths wide, their lookup tables and the kernels that
+// count into them. Bin num_bins is one past the last, no pair reaches it.
+struct pair_counter {
+    int width;                 // In thousandths
+    int num_bins;
+    int wide;                  // Wide coordinates, counted by the wide kernel
+    int key_bits;
+    int key_variant;           // Index of key_bits among the kernel instances
+    uint32_t clamp;            // Smallest dist_sq past the last bin
+    uint16_t *key_table;       // Padded for 32-bit gathers
+    int32_t *upper;            // Largest dist_sq of each bin
+    int64_t *wide_upper;       // Wide upper, from index -1
+    double inverse_width;
+    const char *kernel_name;
+    pair_row_fn row;
+    pair_tile_fn tile;         // With the GEMM engine, for the pairs of different tiles
+    int tile_cells;
+    int task_grain;
+};
+
+// Bin width in thousandths for a width in units, -1 unless it is a multiple
+// of 0.01 up to 100000
+int pair_bin_width(double width);
+
+// Bins width thousandths wide, width being at least 10, for the distances
+// up to sqrt(max_dist_sq). Selects the fastest kernel, see
+// pair_counter_select. Returns 0 if the bins are too narrow for the bin
+// tables, too many for an int or memory runs out.
+int pair_counter_init(pair_counter_t *pc, int width, int64_t max_dist_sq, int wide);
+void pair_counter_free(pair_counter_t *pc);
+
+// Selects the pair kernel by name, or the fastest supported one if name is
+// NULL, and with gemm its GEMM engine. Returns 0 if the kernel is unknown
+// or not supported by the CPU.
+int pair_counter_select(pair_counter_t *pc, const char *name, int gemm);
+
+// Sets the tiling of the kernels, a value of 0 keeping the default.
+// tile_cells is capped at MAX_TILE_CELLS.
+void pair_counter_tune(pair_counter_t *pc, int tile_cells, int task_grain);
+
+// Bin of a compact squared distance
+int pair_counter_bin(const pair_counter_t *pc, uint32_t dist_sq);
+
+// Per-thread histograms kept for the whole run. Each thread counts into
+// 32-bit bins, 14 KiB for 0.01 bins and less for coarser ones, that stay in
+// L1, and moves them into its 64-bit bins before any of them could
+// overflow. The threads' bins are only summed once, at the end.
+typedef struct {
+    uint32_t *counts;          // num_bins + 1 bins, allocated with the struct
+    uint64_t pending;          // Pairs counted in counts since the last flush
+    uint64_t *totals;
+} thread_hist_t;
+
+typedef struct {
+    int num_threads;
+    int num_bins;
+    thread_hist_t **threads;
+} thread_hists_t;
+
+// Returns 0 if memory runs out
+int pair_hists_init(thread_hists_t *hists, int num_threads, int num_bins);
+void pair_hists_free(thread_hists_t *hists);
+void pair_hists_clear(thread_hists_t *hists);
+// Sum the threads' histograms into counts, each thread taking a range of bins
+void pair_hists_merge(const thread_hists_t *hists, long int *counts);
+// Called before counting num_pairs more pairs on the calling thread
+thread_hist_t *pair_hists_reserve(thread_hists_t *hists, long int num_pairs);
+
+// Distances between the cells of chunk, counted into the calling threads'
+// histograms
+void pair_count_in_chunk(const pair_counter_t *pc, const chunk_coords_t *chunk, thread_hists_t *hists);
+
+// Distances between two different chunks, counted into the calling
+// threads' histograms. With thread_node, chunk2 holds a copy of the chunk
+// for each NUMA node and every thread reads the one of its node,
+// thread_node[omp_get_thread_num()].
+void pair_count_between_chunks(const pair_counter_t *pc, const chunk_coords_t *chunk1, const chunk_coords_t *chunk2,
+                               const int *thread_node, thread_hists_t *hists);
+
+#endif
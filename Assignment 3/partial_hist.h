@@ -0,0 +1,27 @@
+#ifndef PARTIAL_HIST_H
+#define PARTIAL_HIST_H
+
+#include <stdint.h>
+
+// Raw partial histogram written by "distances --shard k/N": this header,
+// then num_bins uint64_t counts in native byte order. The merge tool checks
+// that the shards agree on the input, by its size and a checksum of its
+// rows, and on its split into chunks.
+#define PARTIAL_HIST_MAGIC "DISTPART"
+#define PARTIAL_HIST_VERSION 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t shard;           // 0 .. num_shards - 1
+    uint32_t num_shards;
+    uint32_t num_bins;
+    uint64_t num_cells;
+    uint64_t max_cells;       // Cells per chunk
+    uint32_t bin_width;       // In thousandths
+    uint32_t reserved;
+    uint64_t input_bytes;     // Size of the cell file
+    uint64_t input_checksum;  // Of the text of its rows
+} partial_hist_header_t;
+
+#endif
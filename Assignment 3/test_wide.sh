@@ -0,0 +1,83 @@
+#!/bin/sh
+# Check distances on cells that need wide coordinates against a brute-force
+# histogram.
+#
+# Usage: ./test_wide.sh [cells]             (default: 500)
+#
+# The cells are spread over [-999.999, 999.999] on every axis, including two
+# opposite corners, so the longest distance is the full diagonal, 3464.10.
+# distances runs with the default memory budget, where every bin up to the
+# diagonal must still be counted.
+#
+# Prints one line per run and exits nonzero if any run differs.
+
+set -e
+
+cd "$(dirname "$0")"
+make -s distances
+
+CELLS=${1:-500}
+BIN=$(realpath distances)
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+# Park-Miller, whose products stay exact in awk's doubles
+awk -v n="$CELLS" 'function coord() {
+        state = (state * 16807) % 2147483647
+        return state % 1999999 - 999999
+    }
+    function row(x, y, z) {
+        printf "%s %s %s\n", fmt(x), fmt(y), fmt(z)
+    }
+    function fmt(v) {
+        return sprintf("%s%03d.%03d", v < 0 ? "-" : "+", int((v < 0 ? -v : v) / 1000), (v < 0 ? -v : v) % 1000)
+    }
+    BEGIN {
+        state = 1
+        row(-999999, -999999, -999999)
+        row(999999, 999999, 999999)
+        for (i = 2; i < n; ++i) {
+            x = coord(); y = coord(); z = coord()
+            row(x, y, z)
+        }
+    }' > cells
+
+# Bin b holds the distances in [(b - 1/2) width, (b + 1/2) width), decided
+# on the exact squared distance in thousandths
+brute_force() {
+    awk -v width="$1" '{
+            x[NR] = $1 * 1000; y[NR] = $2 * 1000; z[NR] = $3 * 1000
+        }
+        END {
+            w = width * 1000
+            for (i = 1; i <= NR; ++i) {
+                for (j = i + 1; j <= NR; ++j) {
+                    dx = x[i] - x[j]; dy = y[i] - y[j]; dz = z[i] - z[j]
+                    dist_sq = dx * dx + dy * dy + dz * dz
+                    b = int(sqrt(dist_sq) / w + 0.5)
+                    while (4 * dist_sq >= (w * (2 * b + 1)) ^ 2) ++b
+                    while (b > 0 && 4 * dist_sq < (w * (2 * b - 1)) ^ 2) --b
+                    ++counts[b]
+                }
+            }
+            for (b in counts) printf "%05.2f %d\n", b * width, counts[b]
+        }' cells | sort -n
+}
+
+status=0
+for width in 0.01 0.05; do
+    brute_force "$width" > expected.out
+    for args in "-t1" "-t2" "-t2 --pipeline"; do
+        # shellcheck disable=SC2086
+        "$BIN" $args -b"$width" > run.out
+        if cmp -s run.out expected.out; then
+            echo "ok: -b$width $args"
+        else
+            echo "MISMATCH: -b$width $args"
+            status=1
+        fi
+    done
+done
+exit $status
@@ -23,6 +23,9 @@ typedef struct {
 } int_padded;
 
 
+// Iterates every pixel of one row of the picture, see newton_row
+typedef void (*newton_row_fn)(float imaginary_part, int sz, uint8_t *attractor, uint8_t *convergence);
+
 typedef struct {
   int ib;
   int istep;
@@ -31,7 +34,7 @@ typedef struct {
   mtx_t *mtx;
   cnd_t *cnd;
   int_padded *status;
-  complex float (*handle_degree)(complex float);
+  newton_row_fn handle_degree;
 } thrd_info_t;
 
 typedef struct {
@@ -78,6 +81,124 @@ void initialize_grayscale() {
 }
 
 
+// Complex product without the inf/nan handling of the * operator
+static inline complex float
+cmul(complex float a, complex float b)
+{
+  const float ar = crealf(a), ai = cimagf(a);
+  const float br = crealf(b), bi = cimagf(b);
+  return CMPLXF(ar * br - ai * bi, ar * bi + ai * br);
+}
+
+// u^n for n < MAX_DEGREE by the shortest chain of products
+static inline __attribute__((always_inline)) complex float
+power(complex float u, const int n)
+{
+  complex float u2, u3;
+  switch (n) {
+    case 0:
+      return 1.0f;
+    case 1:
+      return u;
+    case 2:
+      return cmul(u, u);
+    case 3:
+      u2 = cmul(u, u);
+      return cmul(u2, u);
+    case 4:
+      u2 = cmul(u, u);
+      return cmul(u2, u2);
+    case 5:
+      u2 = cmul(u, u);
+      return cmul(cmul(u2, u2), u);
+    case 6:
+      u3 = cmul(cmul(u, u), u);
+      return cmul(u3, u3);
+    case 7:
+      u2 = cmul(u, u);
+      u3 = cmul(u2, u);
+      return cmul(cmul(u2, u2), u3);
+    default:
+      u2 = cmul(u, u);
+      u2 = cmul(u2, u2);
+      return cmul(u2, u2);
+  }
+}
+
+// Newton iteration for x^degree - 1 on every pixel of a row, degree being a
+// constant in each instance. The step
+//   z - (z^d - 1) / (d z^(d-1)) = ((d - 1) z + (1/z)^(d-1)) / d
+// needs a single reciprocal, 1/z = conj(z) / |z|^2, with |z|^2 known from
+// the checks. The roots are e^(2 pi i k / d), so only the one nearest in
+// angle can be within 1e-3 of z.
+static inline __attribute__((always_inline)) void
+newton_row(const int degree, float imaginary_part, int sz, uint8_t *attractor, uint8_t *convergence)
+{
+  const complex float *root = roots[degree - 1];
+  const float keep = (float)(degree - 1) / degree;
+  const float inv_degree = 1.0f / degree;
+  const float sector = degree / (2.0f * (float)M_PI);
+
+  for ( int cx = 0; cx < sz; ++cx ) {
+    attractor[cx] = 10; // last index in color array
+    convergence[cx] = 127;
+    float real_part = -2.0f + (4.0f * (float)cx) / ((float)sz - 1);
+    complex float z = CMPLXF(real_part, imaginary_part);
+
+    for (int conv = 0; conv < MAX_ITERATIONS; ++conv) {
+      const float re = crealf(z), im = cimagf(z);
+      if (fabsf(re) > 1e5f || fabsf(im) > 1e5f) {
+        convergence[cx] = conv;
+        break;
+      }
+
+      float norm_squared = re * re + im * im;
+
+      // check for lower bound of the absolute value of x
+      if (norm_squared < 1e-6f) {
+        break;
+      }
+
+      if (norm_squared <= (1 + 2e-6f) && norm_squared >= (1 - 2e-6f)) {
+        int root_index = (int)lroundf(atan2f(im, re) * sector);
+        root_index = (root_index % degree + degree) % degree;
+        float dx = re - crealf(root[root_index]);
+        float dy = im - cimagf(root[root_index]);
+        if (dx * dx + dy * dy < 1e-6f) { // (1e-3)^2
+          attractor[cx] = root_index;
+          convergence[cx] = conv;
+          break;
+        }
+      }
+
+      const float scale = 1.0f / norm_squared;
+      complex float w = power(CMPLXF(re * scale, -im * scale), degree - 1);
+      z = CMPLXF(keep * re + inv_degree * crealf(w), keep * im + inv_degree * cimagf(w));
+    }
+  }
+}
+
+// One instance per degree, picked once by the threads from newton_rows
+#define NEWTON_ROW_INSTANCE(degree) \
+  static void newton_row_##degree(float imaginary_part, int sz, uint8_t *attractor, uint8_t *convergence) { \
+    newton_row(degree, imaginary_part, sz, attractor, convergence); \
+  }
+NEWTON_ROW_INSTANCE(1)
+NEWTON_ROW_INSTANCE(2)
+NEWTON_ROW_INSTANCE(3)
+NEWTON_ROW_INSTANCE(4)
+NEWTON_ROW_INSTANCE(5)
+NEWTON_ROW_INSTANCE(6)
+NEWTON_ROW_INSTANCE(7)
+NEWTON_ROW_INSTANCE(8)
+NEWTON_ROW_INSTANCE(9)
+
+static const newton_row_fn newton_rows[MAX_DEGREE] = {
+  newton_row_1, newton_row_2, newton_row_3, newton_row_4, newton_row_5,
+  newton_row_6, newton_row_7, newton_row_8, newton_row_9,
+};
+
+
 int
 main_thrd(
     void *args
@@ -91,7 +212,7 @@ main_thrd(
   mtx_t *mtx = thrd_info->mtx;
   cnd_t *cnd = thrd_info->cnd;
   int_padded *status = thrd_info->status;
-  // complex float (*handle_degree)(complex float) = thrd_info->handle_degree;
+  const newton_row_fn handle_degree = thrd_info->handle_degree;
   for ( int ix = ib; ix < sz; ix += istep ) {
 
    uint8_t *attractor = (uint8_t*) malloc(sz*sizeof(uint8_t));
@@ -99,92 +220,8 @@ main_thrd(
 
     // Calculate the imaginary part of the complex plane, take the negative because we want to start at the top left corner
     float imaginary_part = (-2.0f + (4.0f * (float)ix) / ((float)sz - 1)) * -1;
-    
-    for ( size_t cx = 0; cx < sz; ++cx ) {
-      attractor[cx] = 10; // last index in color array
-      convergence[cx] = 127;
-      float real_part = -2.0f + (4.0f * (float)cx) / ((float)sz - 1);
-      complex float z = real_part + imaginary_part * I;
-
-      for (int conv = 0; conv < MAX_ITERATIONS; ++conv) {
-        if (fabs(creal(z)) > 1e5 || fabs(cimag(z)) > 1e5) {
-          attractor[cx] = 10; // last index in color array
-          convergence[cx] = conv;
-          break;
-        }
-
-        
-        float norm_squared = creal(z) * creal(z) + cimag(z) * cimag(z);
-
-        // check for lower bound of the absolute value of x
-        if (norm_squared < 1e-6) {
-          break;
-        }
-
-        if (norm_squared <= (1 + 2e-6) && norm_squared >= (1 - 2e-6)) {
-          
-        
-         
-          for (int root_index = 0; root_index < d; root_index++) {
-              complex float root = roots[d - 1][root_index];
-              float dx = crealf(z) - crealf(root);
-              float dy = cimagf(z) - cimagf(root);
-              float distance_sq = dx * dx + dy * dy;
-              if (distance_sq < 1e-6) { // (1e-3)^2
-                attractor[cx] = root_index;
-                convergence[cx] = conv;
-                break;
-              }
-            }
-
-          if (attractor[cx] != 10) {
-            break;
-          }
-
-          
-          
-        }
-
-        switch (d) {
-          case 1:
-              z = 1.0f;
-              break;
-          case 2:
-              z = (z + (1.0f / z)) / 2.0f;
-              break;
-          case 3:
-              z = (2.0f * z + (1.0f / (z * z))) / 3.0f;
-              break;
-          case 4:
-              z = (3.0f * z + (1.0f / (z * z * z))) / 4.0f;
-              break;
-          case 5:
-              z = (4.0f * z + (1.0f / (z * z * z * z))) / 5.0f;
-              break;
-          case 6:
-              z = (5.0f * z + (1.0f / (z * z * z * z * z))) / 6.0f;
-              break;
-          case 7:
-              z = (6.0f * z + (1.0f / (z * z * z * z * z * z))) / 7.0f;
-              break;
-          case 8:
-              z = (7.0f * z + (1.0f / (z * z * z * z * z * z * z))) / 8.0f;
-              break;
-          case 9:
-              z = (8.0f * z + (1.0f / (z * z * z * z * z * z * z * z))) / 9.0f;
-              break;
-          case 10:
-              z = (9.0f * z + (1.0f / (z * z * z * z * z * z * z * z * z))) / 10.0f;
-              break;
-          default:
-              // Handle invalid degree; exit iteration
-              break;
-      }
-
-      }
 
-      
-    }
+    handle_degree(imaginary_part, sz, attractor, convergence);
 
     mtx_lock(mtx);
     attractors[ix] = attractor;
@@ -301,6 +338,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (d < 1 || d > MAX_DEGREE) {
+        fprintf(stderr, "Polynomial exponent must be between 1 and %d\n", MAX_DEGREE);
+        exit(1);
+    }
+
     // Print out the parsed values
     printf("Number of threads: %d\n", nthrds);
     printf("Picture size: %d x %d\n", sz, sz);
@@ -349,7 +391,7 @@ int main(int argc, char *argv[]) {
     thrds_info[tx].mtx = &mtx;
     thrds_info[tx].cnd = &cnd;
     thrds_info[tx].status = status;
-    // thrds_info[tx].handle_degree = handle_degree;
+    thrds_info[tx].handle_degree = newton_rows[d - 1];
     status[tx].val = 0;
 
     int r = thrd_create(thrds+tx, main_thrd, (void*) (thrds_info+tx));